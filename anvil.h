@@ -1,6 +1,9 @@
+#ifndef ANVIL_H
+#define ANVIL_H
+
 
 #include <linux/perf_event.h>
-#include <linux/kfifo.h>
+#include <linux/percpu.h>
 #include "linux/mm_types.h"
 
 
@@ -19,14 +22,24 @@ extern unsigned int pre_str_sample_period;
 /* count period in nanoseconds */
 extern unsigned int count_timer_period;
 
+/* count period in use, count_timer_period unless backed off */
+extern unsigned int count_period_current;
+
 /* sample period  in nanoseconds */
 extern unsigned int sample_timer_period;
 
 extern unsigned int aggressor_threshold_percentage;
 
+/* sampling events enabled for a window */
+#define SAMPLE_LOADS	(1 << 0)
+#define SAMPLE_STORES	(1 << 1)
+
 /* Maximum number of addresses in the address profile */
 #define PROFILE_N 20
 
+/* Pages tracked by the heavy-hitter table while a window is profiled */
+extern unsigned int profile_table_entries;
+
 /* Maximum number of samples */
 #define SAMPLES_MAX 150
 
@@ -42,18 +55,36 @@ extern struct perf_event_attr load_latency_event;
 /*precise store event*/
 extern struct perf_event_attr precise_str_event_attr;
 
+/* per-CPU counting events */
+DECLARE_PER_CPU(struct perf_event *, llc_event);
+DECLARE_PER_CPU(struct perf_event *, l1D_event);
+/* per-CPU sampling events */
+DECLARE_PER_CPU(struct perf_event *, ld_lat_event);
+DECLARE_PER_CPU(struct perf_event *, precise_str_event);
+/* samples taken after their window closed, per CPU */
+DECLARE_PER_CPU(unsigned long, late_samples);
+
+/* overflow handlers of the sampling events */
+void load_latency_callback(struct perf_event *event,
+            struct perf_sample_data *data,
+            struct pt_regs *regs);
+void precise_str_callback(struct perf_event *event,
+            struct perf_sample_data *data,
+            struct pt_regs *regs);
+
 /* Address profile */
 typedef struct{
+	/* physical page, or row key (dram_row_key()) with row_aggregation */
 	unsigned long phy_page;
-	struct mm_struct *mm;
-	unsigned long page;
-	int ld_st;
+	/* upper bound of the samples on phy_page */
 	unsigned long llc_total_miss;
+	/* llc_total_miss overestimates by at most err */
+	unsigned long err;
+	/* misses estimated for phy_page, decayed sum over the recent windows */
+	unsigned long activity;
 	unsigned int llc_percent_miss;
 	int cpu;
-unsigned long dummy1;
-unsigned long dummy2;
-int hammer;
+	int hammer;
 } profile_t;
 
 /* Address sample */
@@ -62,6 +93,10 @@ typedef struct{
 	struct mm_struct *mm;
 	u64 virt_addr;
 	u32 cpu;
+	/* generation of the window the sample was taken in */
+	u32 gen;
+	/* thread that caused the sample */
+	pid_t tid;
 }sample_t;
 
 /* for logging */
@@ -73,4 +108,4 @@ struct sample_log{
 	int cpu;
 };
 
-
+#endif // ANVIL_H
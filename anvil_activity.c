@@ -0,0 +1,169 @@
+// Decayed address activity across sample windows
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+
+#include "anvil.h"
+#include "anvil_activity.h"
+
+/*
+ * Exponentially decayed sum of the misses each address caused per window.
+ * The activity is decayed lazily, once per sample_timer_period boundary
+ * crossed since its last update, and the misses of the new window are added
+ * in full. Stamps sit on period boundaries and advance by whole periods, so
+ * updates less than a period apart still decay once per period instead of
+ * never. A single window counts as much as it did on its own, while a page
+ * hammered for several periods builds up more than its per-period miss rate
+ * (up to 1 / (1 - decay) times it), so it is caught with fewer samples.
+ *
+ * The table is set associative, a new address replaces the way with the
+ * lowest decayed activity of its set.
+ */
+
+#define ACTIVITY_WAYS 8
+
+struct activity {
+	unsigned long key;
+	u64 misses;
+	/* period boundary the misses are decayed to, 0 for an empty way */
+	u64 stamp;
+};
+
+/* Period of the decay self-check, in ns */
+#define ACTIVITY_SELFTEST_PERIOD 1000
+
+static struct activity *table;
+static unsigned int set_bits;
+static unsigned int tracked;
+
+/* @misses after @steps periods that keep @pct percent each */
+static u64 activity_decay(u64 misses, u64 steps, unsigned int pct)
+{
+	for (; steps && misses; steps--)
+		misses = div_u64(misses * pct, 100);
+
+	return misses;
+}
+
+/* Decay @entry to the last period boundary before @now. The rest of the
+ * period stays ahead of the stamp and counts towards the next decay. */
+static void activity_age(struct activity *entry, u64 now, u32 period, unsigned int pct)
+{
+	u64 steps = div_u64(now - entry->stamp, period);
+
+	entry->misses = activity_decay(entry->misses, steps, pct);
+	entry->stamp += steps * period;
+}
+
+/* Updates half a period apart must decay once per full period, not on
+ * every update and not never */
+static int activity_selftest(void)
+{
+	struct activity entry = {
+		.key = 1,
+		.misses = 1024,
+		.stamp = 4 * ACTIVITY_SELFTEST_PERIOD,
+	};
+	u64 now = entry.stamp;
+	int i;
+
+	for (i = 1; i <= 8; i++) {
+		now += ACTIVITY_SELFTEST_PERIOD / 2;
+		activity_age(&entry, now, ACTIVITY_SELFTEST_PERIOD, 50);
+		if (entry.misses != 1024 >> (i / 2)) {
+			printk(KERN_ERR "anvil: activity decayed to %llu after %d half periods\n",
+			       entry.misses, i);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+u64 activity_update(unsigned long key, u64 misses, u64 now)
+{
+	struct activity *set, *entry = NULL, *victim = NULL;
+	unsigned int pct = min(READ_ONCE(activity_decay_percent), 99U);
+	u32 period = max(READ_ONCE(sample_timer_period), 1U);
+	u64 victim_misses = U64_MAX, decayed;
+	u32 rem;
+	int way;
+
+	set = &table[hash_long(key, set_bits) * ACTIVITY_WAYS];
+	for (way = 0; way < ACTIVITY_WAYS; way++) {
+		if (!set[way].stamp) {
+			if (victim_misses) {
+				victim = &set[way];
+				victim_misses = 0;
+			}
+			continue;
+		}
+		if (set[way].key == key) {
+			entry = &set[way];
+			break;
+		}
+		decayed = activity_decay(set[way].misses,
+					 div_u64(now - set[way].stamp, period), pct);
+		if (decayed < victim_misses) {
+			victim = &set[way];
+			victim_misses = decayed;
+		}
+	}
+
+	if (entry) {
+		activity_age(entry, now, period, pct);
+	} else {
+		entry = victim;
+		if (!entry->stamp)
+			tracked++;
+		entry->key = key;
+		entry->misses = 0;
+		/* start on the boundary before now */
+		div_u64_rem(now, period, &rem);
+		entry->stamp = now - rem;
+	}
+
+	/* decayed above, the new window adds in full */
+	entry->misses += misses;
+
+	return entry->misses;
+}
+
+void activity_table_reset(void)
+{
+	memset(table, 0, ((size_t)ACTIVITY_WAYS << set_bits) * sizeof(*table));
+	tracked = 0;
+}
+
+unsigned int activity_tracked(void)
+{
+	return tracked;
+}
+
+int activity_table_init(unsigned int size)
+{
+	unsigned int sets;
+	int ret;
+
+	ret = activity_selftest();
+	if (ret)
+		return ret;
+
+	sets = roundup_pow_of_two(max_t(unsigned int, size, ACTIVITY_ENTRIES_MIN) / ACTIVITY_WAYS);
+	set_bits = ilog2(sets);
+
+	table = kvcalloc(sets * ACTIVITY_WAYS, sizeof(*table), GFP_KERNEL);
+	if (!table)
+		return -ENOMEM;
+
+	tracked = 0;
+	return 0;
+}
+
+void activity_table_exit(void)
+{
+	kvfree(table);
+	table = NULL;
+}
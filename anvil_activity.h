@@ -0,0 +1,28 @@
+#ifndef ANVIL_ACTIVITY_H
+#define ANVIL_ACTIVITY_H
+
+#include <linux/types.h>
+
+/* Minimum number of entries of the activity table */
+#define ACTIVITY_ENTRIES_MIN 64
+
+/* share of the activity kept per sample_timer_period, in percent */
+extern unsigned int activity_decay_percent;
+/* number of addresses whose activity is tracked across windows */
+extern unsigned int activity_table_entries;
+
+/* Checks the decay, then allocates at least @size entries */
+int activity_table_init(unsigned int size);
+void activity_table_exit(void);
+
+/* Add the @misses estimated for @key in the window analyzed at @now (ns)
+ * to its decayed activity, returns the new estimate */
+u64 activity_update(unsigned long key, u64 misses, u64 now);
+
+/* forget every address, e.g. row keys of a replaced DRAM mapping */
+void activity_table_reset(void);
+
+/* number of addresses with a tracked activity */
+unsigned int activity_tracked(void);
+
+#endif // ANVIL_ACTIVITY_H
@@ -21,40 +21,191 @@
 #include <linux/mm_types.h>
 #include <linux/mm.h>
 #include <linux/sched/mm.h>
+#include <linux/version.h>
+#include <linux/hash.h>
+#include <linux/irq_work.h>
+#include <linux/sched/clock.h>
+#include <linux/cpu.h>
+#include <linux/cpuhotplug.h>
+#include <linux/random.h>
+#include <linux/kthread.h>
+#include <uapi/linux/sched/types.h>
 
 #include "anvil.h"
 #include "dram_mapping.h"
 #include "anvil_sysfs.h"
+#include "anvil_samples.h"
+#include "anvil_profile.h"
+#include "anvil_refresh.h"
+#include "anvil_monitor.h"
+#include "anvil_period.h"
+#include "anvil_targets.h"
+#include "anvil_activity.h"
+#include "anvil_migrate.h"
+
+#define CREATE_TRACE_POINTS
+#include "anvil_trace.h"
 
 
 #define MIN_SAMPLES 0
-#define REFRESHED_ROWS 1
+
+/* Ring slots per expected sample in a window, covers bursts above the threshold */
+#define SAMPLE_RING_HEADROOM 4
+/* Upper bound of a single per-CPU sample ring */
+#define SAMPLE_RING_MAX 16384
+/* Upper bound of the merged samples analyzed per window */
+#define SAMPLES_MERGE_MAX 16384
+
+/* Count ticks may be deferred by period >> TIMER_SLACK_SHIFT to coalesce wakeups */
+#define TIMER_SLACK_SHIFT 3
+/* The count period backs off while misses stay below threshold / BACKOFF_MISS_DIVISOR */
+#define BACKOFF_MISS_DIVISOR 4
+
+/* log2 of the number of entries in the per-window translation cache */
+#define XLAT_CACHE_BITS 6
 
 /* Default thresholds and timing (can be overridden via module parameters) */
 unsigned int llc_miss_threshold = 20000;
 module_param(llc_miss_threshold, uint, 0644);
 MODULE_PARM_DESC(llc_miss_threshold, "Threshold of LLC misses before sampling starts");
 
+/* A new sample period drops the adjustments of the period controller */
+static int set_sample_period(const char *val, const struct kernel_param *kp)
+{
+	unsigned int period;
+	int ret;
+
+	ret = kstrtouint(val, 0, &period);
+	if (ret)
+		return ret;
+	if (!period)
+		return -EINVAL;
+
+	*(unsigned int *)kp->arg = period;
+	sample_periods_reset();
+	return 0;
+}
+
+static const struct kernel_param_ops sample_period_ops = {
+	.set = set_sample_period,
+	.get = param_get_uint,
+};
+
 unsigned int ld_lat_sample_period = 50;
-module_param(ld_lat_sample_period, uint, 0444);
-MODULE_PARM_DESC(ld_lat_sample_period, "Load latency sample period");
+module_param_cb(ld_lat_sample_period, &sample_period_ops, &ld_lat_sample_period, 0644);
+MODULE_PARM_DESC(ld_lat_sample_period, "Load latency sample period (lowest period the controller uses)");
 
 unsigned int pre_str_sample_period = 3000;
-module_param(pre_str_sample_period, uint, 0444);
-MODULE_PARM_DESC(pre_str_sample_period, "Precise store sample period");
+module_param_cb(pre_str_sample_period, &sample_period_ops, &pre_str_sample_period, 0644);
+MODULE_PARM_DESC(pre_str_sample_period, "Precise store sample period (lowest period the controller uses)");
+
+unsigned int sample_budget_us = 50;
+module_param(sample_budget_us, uint, 0644);
+MODULE_PARM_DESC(sample_budget_us, "Sampling interrupt time allowed per CPU, in microseconds per millisecond (0 keeps the sample periods fixed)");
+
+unsigned int sample_target = 100;
+module_param(sample_target, uint, 0644);
+MODULE_PARM_DESC(sample_target, "Samples a window should collect, below it sample periods are lowered again");
 
 unsigned int count_timer_period = 6000000;
 module_param(count_timer_period, uint, 0644);
 MODULE_PARM_DESC(count_timer_period, "Count timer period in nanoseconds");
 
+unsigned int count_timer_max_period = 48000000;
+module_param(count_timer_max_period, uint, 0644);
+MODULE_PARM_DESC(count_timer_max_period, "Longest count timer period in nanoseconds while LLC misses stay low (at most count_timer_period disables the backoff)");
+
 unsigned int sample_timer_period = 6000000;
 module_param(sample_timer_period, uint, 0644);
 MODULE_PARM_DESC(sample_timer_period, "Sample timer period in nanoseconds");
 
+unsigned int profile_table_entries = 64;
+module_param(profile_table_entries, uint, 0444);
+MODULE_PARM_DESC(profile_table_entries, "Number of pages tracked while profiling a window (at least 20). Every page with more than samples/entries samples is guaranteed to be kept");
+
+unsigned int activity_table_entries = 1024;
+module_param(activity_table_entries, uint, 0444);
+MODULE_PARM_DESC(activity_table_entries, "Number of pages whose activity is tracked across windows (at least 64)");
+
+unsigned int activity_decay_percent = 50;
+module_param(activity_decay_percent, uint, 0644);
+MODULE_PARM_DESC(activity_decay_percent, "Share of a page's activity kept per sample_timer_period (0-99, 0 keeps only the current period)");
+
+bool row_aggregation = false;
+module_param(row_aggregation, bool, 0444);
+MODULE_PARM_DESC(row_aggregation, "Profile DRAM rows (rank, bank, row) instead of physical pages and detect double-sided aggressor pairs");
+
+bool para_mode = false;
+module_param(para_mode, bool, 0444);
+MODULE_PARM_DESC(para_mode, "Skip profiling, refresh the neighbour rows of a random share of the sampled addresses instead (PARA)");
+
+unsigned int para_probability_ppm = 10000;
+module_param(para_probability_ppm, uint, 0644);
+MODULE_PARM_DESC(para_probability_ppm, "Probability, in parts per million, that a sample refreshes its neighbour rows in PARA mode");
+
+unsigned int migrate_after = 0;
+module_param(migrate_after, uint, 0644);
+MODULE_PARM_DESC(migrate_after, "Migrate an aggressor page to another bank after this many detections instead of refreshing its victims (0 disables)");
+
+bool phys_addr_sampling = true;
+module_param(phys_addr_sampling, bool, 0444);
+MODULE_PARM_DESC(phys_addr_sampling, "Look up physical addresses in the overflow handler (GUP-fast walk) instead of translating virtual addresses later");
+
+unsigned int blast_radius = 1;
+module_param(blast_radius, uint, 0644);
+MODULE_PARM_DESC(blast_radius, "Number of rows refreshed on each side of an aggressor row (1-8)");
+
+unsigned int refresh_window_ms = 64;
+module_param(refresh_window_ms, uint, 0644);
+MODULE_PARM_DESC(refresh_window_ms, "DRAM refresh window in milliseconds");
+
+unsigned int refresh_suppress_percent = 25;
+module_param(refresh_suppress_percent, uint, 0644);
+MODULE_PARM_DESC(refresh_suppress_percent, "Skip victim rows refreshed within this percentage of the refresh window (0 disables)");
+
+bool percpu_monitor = false;
+module_param(percpu_monitor, bool, 0444);
+MODULE_PARM_DESC(percpu_monitor, "Read LLC miss counters on each CPU from a local timer instead of reading every CPU from one timer");
+
+bool llc_overflow_trigger = false;
+module_param(llc_overflow_trigger, bool, 0444);
+MODULE_PARM_DESC(llc_overflow_trigger, "Arm sampling from LLC miss counter overflows instead of polling the counters every count_timer_period");
+
+unsigned int sample_cpu_share = 10;
+module_param(sample_cpu_share, uint, 0644);
+MODULE_PARM_DESC(sample_cpu_share, "Only CPUs with at least this percentage of the LLC misses sample (0 samples on every CPU)");
+
+unsigned int task_target_share = 0;
+module_param(task_target_share, uint, 0644);
+MODULE_PARM_DESC(task_target_share, "Sample only the threads that caused this percentage of a window's samples, if there are at most 4 of them (0 disables)");
+
+unsigned int task_idle_windows = 2;
+module_param(task_idle_windows, uint, 0644);
+MODULE_PARM_DESC(task_idle_windows, "Windows with fewer than sample_target samples after which per-task sampling falls back to sampling on the CPUs");
+
+unsigned int task_rescan_windows = 8;
+module_param(task_rescan_windows, uint, 0644);
+MODULE_PARM_DESC(task_rescan_windows, "Per-task windows after which one window is sampled on the CPUs to choose the threads again (0 never)");
+
 unsigned int aggressor_threshold_percentage = 50;
 module_param(aggressor_threshold_percentage, uint, 0644);
 MODULE_PARM_DESC(aggressor_threshold_percentage, "Configures the threshold for flagging a memory page as a potential Rowhammer aggressor, specified as a percentage (1-100). A lower percentage makes the detection more aggressive.");
 
+bool detect_kthread = false;
+module_param(detect_kthread, bool, 0444);
+MODULE_PARM_DESC(detect_kthread, "Run state transitions and window analysis in dedicated kernel threads instead of workqueues");
+
+int detect_kthread_priority = 10;
+module_param(detect_kthread_priority, int, 0444);
+MODULE_PARM_DESC(detect_kthread_priority, "SCHED_FIFO priority of the analysis thread (1-99), the state thread runs one above, 0 keeps both SCHED_NORMAL");
+
+char *detect_kthread_cpus = "";
+module_param(detect_kthread_cpus, charp, 0444);
+MODULE_PARM_DESC(detect_kthread_cpus, "CPU list the detection thread may run on, empty for any CPU");
+
+unsigned int refresh_latency_target_us = 10000;
+module_param(refresh_latency_target_us, uint, 0644);
+MODULE_PARM_DESC(refresh_latency_target_us, "Target time from a threshold crossing to the last victim refresh of its window, in microseconds (0 disables violation counting)");
 
 MODULE_LICENSE("GPL");
 
@@ -72,30 +223,99 @@ struct perf_event_attr precise_str_event_attr;
 
 static struct hrtimer sample_timer;
 static ktime_t ktime;
-static u64 old_val,val;
-static u64 old_l1D_val,l1D_val,miss_total;
+static u64 miss_total;
+/* count period in use, count_timer_period unless backed off */
+unsigned int count_period_current;
 
 enum sampling_state {
 	STATE_IDLE,
 	STATE_ARMED,
 	STATE_SAMPLING,
+	/* window is over but misses are still high, close it and keep sampling */
+	STATE_ROLLOVER,
 };
 
 static enum sampling_state current_state = STATE_IDLE;
 static DEFINE_SPINLOCK(sampling_lock);
 
+/* A closed window, waiting for or under analysis */
+struct sample_window {
+	struct work_struct work;
+	struct kthread_work kwork;
+	unsigned int buf;
+	/* generation of the window stored in buf */
+	unsigned long gen;
+	/* LLC misses counted while the window was sampling */
+	u64 miss_total;
+	/* set from close until analyzed, buf must not take a new window */
+	bool busy;
+	/* ktime_get_ns() of the threshold crossing that started the window */
+	u64 crossed;
+	/* sampled through the per-task events of the suspects only */
+	bool per_task;
+};
+
+static struct sample_window windows[SAMPLE_BUFFERS];
+/* generation of the window being sampled, or of the next one */
+static unsigned long window_gen;
+/* generation the enabled sampling events were started for, trails
+ * window_gen from a close until the events are stopped or restarted */
+static unsigned long sampling_gen;
+/* sampling events currently enabled on each CPU, only touched by llc_event_wq */
+static DEFINE_PER_CPU(unsigned int, sampling_events);
+/* CPUs chosen to sample in the current or last window */
+struct cpumask sampling_cpus;
+/* ktime_get_ns() when the current window started sampling */
+static u64 window_start;
+/* threshold crossing of the current window and of the next one, protected
+ * by sampling_lock */
+static u64 window_crossed;
+static u64 next_crossed;
+
 static profile_t profile[PROFILE_N];
 static unsigned int record_size;
-static DEFINE_SPINLOCK(samples_lock);
-static DECLARE_KFIFO(samples, sample_t, roundup_pow_of_two(SAMPLES_MAX));
+
+/* per-CPU rings are merged here when a window is analyzed */
+static sample_t *window_samples;
+static size_t window_capacity;
+
+/* VA->PA translations of the window being analyzed, a failed
+ * translation is cached as well (phys = 0) */
+struct xlat_entry {
+	struct mm_struct *mm;
+	unsigned long vpage;
+	unsigned long phys;
+};
+static struct xlat_entry xlat_cache[1 << XLAT_CACHE_BITS];
 /* counts number of times L1 threhold was
 passed (sampling was done) */
 unsigned long L1_count=0;
 /* counts number of times hammering was detected */
 unsigned long L2_count=0;
-unsigned long refresh_count=0;
+/* samples that had to be translated with get_user_pages_remote */
+unsigned long gup_fallback_count=0;
+/* page table walks done for those samples */
+unsigned long gup_walk_count=0;
+/* windows whose aggressor threshold was below the profile error bound */
+unsigned long profile_undersized_count=0;
+/* windows that were followed by the next one without a monitoring period */
+unsigned long window_rollover_count=0;
+/* aggressor row pairs two rows apart in the same bank */
+unsigned long double_sided_count=0;
+/* time spent analyzing windows with the threshold detector */
+u64 detect_time_ns=0;
+/* PARA mode: samples that won the coin flip, victim rows they refreshed
+ * and time spent on them */
+unsigned long para_sample_count=0;
+unsigned long para_refresh_count=0;
+u64 para_time_ns=0;
 static unsigned int hammer_threshold;
-unsigned long dummy;
+
+/* time from threshold crossing to the last refresh of its window, last
+ * and worst value, and windows above refresh_latency_target_us */
+u64 refresh_latency_ns=0;
+u64 refresh_latency_max_ns=0;
+unsigned long latency_violation_count=0;
 
 /* for logging */
 static struct sample_log log[25000];
@@ -103,22 +323,92 @@ static int log_index=0;
 
 static struct workqueue_struct *action_wq;
 static struct workqueue_struct *llc_event_wq;
-static struct work_struct task;
 static struct work_struct task2;
+/* replace llc_event_wq and action_wq with detect_kthread, state
+ * transitions never wait behind the analysis of a window */
+static struct kthread_worker *state_worker;
+static struct kthread_worker *detect_worker;
+static struct kthread_work task2_kwork;
+
+/* dynamic hotplug state that owns the per-CPU events */
+static int anvil_cpuhp_state;
+
+/* PARA coin flip state of each CPU */
+static DEFINE_PER_CPU(u32, para_seed);
+
+/* arms sampling after an LLC overflow, the NMI handler cannot take locks */
+static struct irq_work llc_trigger_work;
+/* The LLC miss counter overflows LLC_OVERFLOW_SLICES times per
+ * llc_miss_threshold misses. The last overflows of each CPU span exactly
+ * llc_miss_threshold misses, a burst after an idle period is seen after at
+ * most one slice more. */
+#define LLC_OVERFLOW_SLICES 4
+
+struct llc_overflows {
+	/* local_clock() of the last overflows, 0 for none yet */
+	u64 stamp[LLC_OVERFLOW_SLICES];
+	unsigned int next;
+};
+static DEFINE_PER_CPU(struct llc_overflows, llc_overflows);
 
 static void build_profile(size_t sample_total);
-static int profile_compare(const void *a, const void *b);
+static struct perf_event *create_sampling_event(struct perf_event_attr *attr, u64 period, int cpu,
+											   perf_overflow_handler_t callback);
 DEFINE_PER_CPU(struct perf_event *, llc_event);
 DEFINE_PER_CPU(struct perf_event *, l1D_event);
 DEFINE_PER_CPU(struct perf_event *, ld_lat_event);
 DEFINE_PER_CPU(struct perf_event *, precise_str_event);
+DEFINE_PER_CPU(unsigned long, late_samples);
 
 void action_wq_callback( struct work_struct *work);
 void llc_event_wq_callback( struct work_struct *work);
 
+/* state transitions */
+static void queue_state_work(void)
+{
+	if (state_worker)
+		kthread_queue_work(state_worker, &task2_kwork);
+	else
+		queue_work(llc_event_wq, &task2);
+}
+
+/* analysis of a closed window */
+static void queue_window_work(struct sample_window *win)
+{
+	if (detect_worker)
+		kthread_queue_work(detect_worker, &win->kwork);
+	else
+		queue_work(action_wq, &win->work);
+}
+
+static void flush_state_work(void)
+{
+	if (state_worker)
+		kthread_flush_worker(state_worker);
+	else
+		flush_workqueue(llc_event_wq);
+}
+
+/* LLC overflow handler, called every llc_miss_threshold / LLC_OVERFLOW_SLICES
+ * misses on this CPU when llc_overflow_trigger is set */
 void llc_event_callback(struct perf_event *event,
             struct perf_sample_data *data,
-            struct pt_regs *regs){}
+            struct pt_regs *regs)
+{
+	struct llc_overflows *ovf = this_cpu_ptr(&llc_overflows);
+	u64 now = local_clock();
+	u64 first = ovf->stamp[ovf->next];
+
+	ovf->stamp[ovf->next] = now;
+	ovf->next = (ovf->next + 1) % LLC_OVERFLOW_SLICES;
+
+	/* threshold crossed in less than a count period: the miss rate is high */
+	if (!first || now - first >= READ_ONCE(count_timer_period))
+		return;
+
+	if (READ_ONCE(current_state) == STATE_IDLE)
+		irq_work_queue(&llc_trigger_work);
+}
 
 void l1D_event_callback(struct perf_event *event,
             struct perf_sample_data *data,
@@ -131,14 +421,13 @@ void l1D_event_callback(struct perf_event *event,
 
    @return: corresponding physical address of "virt" */
 
+/* Caller must hold mmap_read_lock(mm) */
 static unsigned long virt_to_phy( struct mm_struct *mm,unsigned long virt)
 {
 	unsigned long phys;
 	struct page *pg;
 	int ret;
 
-	mmap_read_lock(mm);
-
 	ret = get_user_pages_remote (
 		mm,
 		virt,
@@ -149,8 +438,6 @@ static unsigned long virt_to_phy( struct mm_struct *mm,unsigned long virt)
 		NULL
     );
 
-	mmap_read_unlock(mm);
-
 	if(ret <= 0) {
 		pr_warn(KERN_WARNING "anvil: get_user_pages_remote failed for va: 0x%lx\n", virt);
 		return 0;
@@ -164,48 +451,203 @@ static unsigned long virt_to_phy( struct mm_struct *mm,unsigned long virt)
 	return phys;
 }
 
-static unsigned long sample_to_pfn(sample_t* sample)
+/* Order samples by address space, then by virtual page. Samples that
+ * already carry a physical address (mm == NULL) end up first. */
+static int sample_compare(const void *a, const void *b)
 {
-	unsigned long pfn;
+	const sample_t *sa = a;
+	const sample_t *sb = b;
+	unsigned long pa = sa->virt_addr >> PAGE_SHIFT;
+	unsigned long pb = sb->virt_addr >> PAGE_SHIFT;
+
+	if (sa->mm != sb->mm)
+		return (unsigned long)sa->mm < (unsigned long)sb->mm ? -1 : 1;
+	if (pa != pb)
+		return pa < pb ? -1 : 1;
+	return 0;
+}
 
-	/* Translate if needed */
-	if (sample->phy_page == 0 && sample->mm) {
-		pfn = virt_to_phy(sample->mm, sample->virt_addr) >> PAGE_SHIFT;
-		mmput(sample->mm); /* Release mm reference */
-	} else {
-		pfn = sample->phy_page >> PAGE_SHIFT;
+/* Translate one virtual page of @mm through the window cache.
+ * Caller must hold mmap_read_lock(mm). */
+static unsigned long xlat_page(struct mm_struct *mm, unsigned long vpage)
+{
+	struct xlat_entry *entry;
+
+	entry = &xlat_cache[hash_long(vpage ^ (unsigned long)mm, XLAT_CACHE_BITS)];
+	if (entry->mm == mm && entry->vpage == vpage)
+		return entry->phys;
+
+	gup_walk_count++;
+	entry->mm = mm;
+	entry->vpage = vpage;
+	entry->phys = virt_to_phy(mm, vpage << PAGE_SHIFT);
+
+	return entry->phys;
+}
+
+/* Translate all samples of the window that were stored without a physical
+ * address. Samples are grouped by (mm, virtual page) so that every distinct
+ * page is walked once, under a single mmap_read_lock hold per mm. */
+static void translate_samples(size_t sample_total)
+{
+	size_t first, i;
+	struct mm_struct *mm;
+	unsigned long phys;
+
+	memset(xlat_cache, 0, sizeof(xlat_cache));
+	sort(window_samples, sample_total, sizeof(sample_t), sample_compare, NULL);
+
+	for (first = 0; first < sample_total; first = i) {
+		mm = window_samples[first].mm;
+		if (!mm) {
+			i = first + 1;
+			continue;
+		}
+
+		mmap_read_lock(mm);
+		for (i = first; i < sample_total && window_samples[i].mm == mm; i++) {
+			gup_fallback_count++;
+			phys = xlat_page(mm, window_samples[i].virt_addr >> PAGE_SHIFT);
+			/* the row may depend on the offset in the page */
+			window_samples[i].phy_page = phys ? phys + offset_in_page(window_samples[i].virt_addr) : 0;
+		}
+		mmap_read_unlock(mm);
+
+		/* Release mm references, one per sample */
+		for (i = first; i < sample_total && window_samples[i].mm == mm; i++) {
+			window_samples[i].mm = NULL;
+			mmput(mm);
+		}
 	}
+}
+
+/* Physical address of a sampled user address, 0 if it is not available.
+ * perf core only fills data->phys_addr in perf_prepare_sample(), which is not
+ * reached with a custom overflow handler, so the handler walks the page tables
+ * itself the way perf core does for PERF_SAMPLE_PHYS_ADDR: interrupts are
+ * disabled in the overflow handler, so the page tables cannot be torn down
+ * under get_user_page_fast_only(). */
+static u64 sample_phys_addr(struct perf_sample_data *data)
+{
+	struct page *pg;
+	u64 phys = 0;
+	unsigned long virt = data->addr;
+
+	if (!virt || virt >= TASK_SIZE || !current->mm)
+		return 0;
+
+	if (get_user_page_fast_only(virt, 0, &pg)) {
+		phys = page_to_phys(pg) + offset_in_page(virt);
+		put_page(pg);
+	}
+
+	return phys;
+}
+
+/* PARA coin flip, true with para_probability_ppm. xorshift32, cheap enough
+ * for the overflow handler. */
+static bool para_coin(void)
+{
+	u32 x = __this_cpu_read(para_seed);
 
-	return pfn;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	__this_cpu_write(para_seed, x);
+
+	return (((u64)x * 1000000) >> 32) < READ_ONCE(para_probability_ppm);
 }
 
 static void store_sample(struct mm_struct* mm,
-						 unsigned long virt_addr)
+						 unsigned long virt_addr,
+						 u64 phys_addr)
 {
-	sample_t sample;
-	unsigned long flags;
+	sample_t *sample;
+	unsigned long gen;
+	unsigned int buf;
+
+	if (!mm)
+		return;
+
+	/* buffer of the window being sampled */
+	gen = READ_ONCE(window_gen);
+	buf = gen % SAMPLE_BUFFERS;
+
+	/* the window closed but its events are still enabled, the sample
+	 * belongs to neither window */
+	if (gen != READ_ONCE(sampling_gen)) {
+		this_cpu_inc(late_samples);
+		return;
+	}
 
-	if (mm && mmget_not_zero(mm)) {
-		sample.virt_addr = virt_addr;
-		sample.phy_page = 0; // Mark for translation
-		sample.mm = mm;
-		sample.cpu = raw_smp_processor_id();
+	/* PARA keeps only the samples that refresh their neighbours */
+	if (para_mode && !para_coin())
+		return;
+
+	/* reserve first, a full ring must not pin the mm */
+	sample = sample_ring_reserve(buf);
+	if (!sample)
+		return;
+
+	sample->gen = gen;
+	sample->tid = current->pid;
+
+	/* fast path, no translation needed later */
+	if (phys_addr) {
+		sample->virt_addr = virt_addr;
+		sample->phy_page = phys_addr;
+		sample->mm = NULL;
+		sample->cpu = raw_smp_processor_id();
+		sample_ring_commit(buf);
+		this_cpu_inc(sample_costs.samples);
+		return;
+	}
 
-		spin_lock_irqsave(&samples_lock, flags);
-		kfifo_put(&samples, sample);
-		spin_unlock_irqrestore(&samples_lock, flags);
+	/* fallback, keep the mm alive until build_profile() translates the sample */
+	if (mmget_not_zero(mm)) {
+		sample->virt_addr = virt_addr;
+		sample->phy_page = 0; // Mark for translation
+		sample->mm = mm;
+		sample->cpu = raw_smp_processor_id();
+		sample_ring_commit(buf);
+		this_cpu_inc(sample_costs.samples);
+	} else {
+		sample_ring_cancel(buf);
 	}
 }
 
+/* Size the per-CPU rings for one sample window.
+ * A single hammering thread may sit on one CPU, so every ring must hold
+ * all samples of a window in which the miss threshold is crossed. */
+static unsigned int sample_ring_size(void)
+{
+	u64 misses, samples;
+	unsigned int period;
+
+	period = min(ld_lat_sample_period, pre_str_sample_period);
+	if (!period || !count_timer_period)
+		return SAMPLE_RING_MAX;
+
+	misses = div_u64((u64)llc_miss_threshold * sample_timer_period, count_timer_period);
+	samples = div_u64(misses * SAMPLE_RING_HEADROOM, period);
+
+	return clamp_t(u64, samples, SAMPLES_MAX, SAMPLE_RING_MAX);
+}
+
 /* Interrupt handler for store sample */
 void precise_str_callback(struct perf_event *event,
             				struct perf_sample_data *data,
             				struct pt_regs *regs)
 {
+	u64 start = local_clock();
+
 	/* Check source of store, if local dram (|0x80) record sample */
 	if(data->data_src.val & (1<<7)){
-		store_sample(current->mm, data->addr);
+		store_sample(current->mm, data->addr,
+					 phys_addr_sampling ? sample_phys_addr(data) : 0);
 	}
+
+	sample_cost_account(start);
 }
 
 /* Interrupt handler for load sample */
@@ -213,161 +655,465 @@ void load_latency_callback(struct perf_event *event,
             struct perf_sample_data *data,
             struct pt_regs *regs)
 {	
-	store_sample(current->mm, data->addr);
+	u64 start = local_clock();
+
+	store_sample(current->mm, data->addr,
+				 phys_addr_sampling ? sample_phys_addr(data) : 0);
+
+	sample_cost_account(start);
 }
 
-void llc_event_wq_callback(struct work_struct *work)
+/* Enable the sampling events in @events on @cpu and disable the others.
+ * May sleep, must not be called under sampling_lock. */
+static void set_sampling_events(int cpu, unsigned int events)
+{
+	unsigned int *current_events = per_cpu_ptr(&sampling_events, cpu);
+	unsigned int changed = events ^ *current_events;
+
+	if(changed & SAMPLE_LOADS){
+		if(events & SAMPLE_LOADS)
+			perf_event_enable(per_cpu(ld_lat_event,cpu));
+		else
+			perf_event_disable(per_cpu(ld_lat_event,cpu));
+	}
+	if(changed & SAMPLE_STORES){
+		if(events & SAMPLE_STORES)
+			perf_event_enable(per_cpu(precise_str_event,cpu));
+		else
+			perf_event_disable(per_cpu(precise_str_event,cpu));
+	}
+	*current_events = events;
+}
+
+/* Sample loads, stores or both based on LLC load miss count */
+static unsigned int choose_sampling_events(u64 ld_miss, u64 llc_miss)
+{
+	if(ld_miss >= (llc_miss*9)/10)
+		return SAMPLE_LOADS;//sample loads only
+	else if(ld_miss < llc_miss/10)
+		return SAMPLE_STORES;//sample stores only
+	else
+		return SAMPLE_LOADS | SAMPLE_STORES;/* sample both */
+}
+
+/* Sampling events are created the first time a CPU samples, CPUs that never
+ * do hold no PEBS counters. Returns the part of @events that is available. */
+static unsigned int get_sampling_events(int cpu, unsigned int events)
+{
+	struct perf_event *event;
+
+	if((events & SAMPLE_LOADS) && !per_cpu(ld_lat_event,cpu)){
+		event = create_sampling_event(&load_latency_event, sample_period_loads(cpu), cpu,
+									  load_latency_callback);
+		if(IS_ERR(event)){
+			pr_warn_ratelimited("anvil: failed to create load latency event on CPU %d\n", cpu);
+			events &= ~SAMPLE_LOADS;
+		} else {
+			per_cpu(ld_lat_event,cpu) = event;
+		}
+	}
+
+	if((events & SAMPLE_STORES) && !per_cpu(precise_str_event,cpu)){
+		event = create_sampling_event(&precise_str_event_attr, sample_period_stores(cpu), cpu,
+									  precise_str_callback);
+		if(IS_ERR(event)){
+			pr_warn_ratelimited("anvil: failed to create precise store event on CPU %d\n", cpu);
+			events &= ~SAMPLE_STORES;
+		} else {
+			per_cpu(precise_str_event,cpu) = event;
+		}
+	}
+
+	return events;
+}
+
+/* Sample on the CPUs that caused at least sample_cpu_share percent of the
+ * misses of the last monitoring period, each with its own load/store split.
+ * Caller holds cpus_read_lock(). */
+static void start_sampling(void)
+{
+	struct sample_window *win = &windows[window_gen % SAMPLE_BUFFERS];
+	unsigned int share = READ_ONCE(sample_cpu_share);
+	unsigned int events;
+	u64 ld_miss, llc_miss, min_miss;
+	int cpu;
+
+	/* samples of the events enabled below belong to this window */
+	WRITE_ONCE(sampling_gen, window_gen);
+
+	/* MEM_LOAD_UOPS_MISC_RETIRED_LLC_MISS since the previous window */
+	ld_miss = monitor_read_load_misses();
+
+	/* a few threads dominated the previous windows, sample only them */
+	events = choose_sampling_events(ld_miss, miss_total);
+	win->per_task = task_targets_start(events);
+	if (win->per_task) {
+		trace_anvil_arm(-1, ld_miss, miss_total, events);
+		cpumask_clear(&sampling_cpus);
+		for_each_online_cpu(cpu)
+			set_sampling_events(cpu, 0);
+		return;
+	}
+
+	min_miss = div_u64(miss_total * share, 100);
+
+	for_each_online_cpu(cpu){
+		llc_miss = monitor_cpu_llc_misses(cpu);
+		events = 0;
+		if(!share || (llc_miss && llc_miss >= min_miss))
+			events = get_sampling_events(cpu,
+					choose_sampling_events(monitor_cpu_load_misses(cpu), llc_miss));
+
+		if (trace_anvil_arm_enabled())
+			trace_anvil_arm(cpu, monitor_cpu_load_misses(cpu), llc_miss, events);
+		if(events)
+			cpumask_set_cpu(cpu, &sampling_cpus);
+		else
+			cpumask_clear_cpu(cpu, &sampling_cpus);
+		set_sampling_events(cpu, events);
+	}
+}
+
+/* Caller holds cpus_read_lock() */
+static void stop_sampling(void)
 {
 	int cpu;
-	u64 enabled,running;
-	u64 ld_miss;
+
+	task_targets_stop();
+
+	for_each_online_cpu(cpu)
+		set_sampling_events(cpu, 0);
+}
+
+/* Close the window being sampled and hand its buffer to the analysis.
+ * Called with sampling_lock held. */
+static struct sample_window *close_window(void)
+{
+	struct sample_window *win = &windows[window_gen % SAMPLE_BUFFERS];
+
+	win->gen = window_gen;
+	win->miss_total = miss_total;
+	win->crossed = window_crossed;
+	win->busy = true;
+
+	/* new samples go to the other buffer from now on */
+	WRITE_ONCE(window_gen, window_gen + 1);
+
+	return win;
+}
+
+/* Arm sampling on an LLC overflow, runs in hard interrupt context */
+static void llc_trigger_callback(struct irq_work *work)
+{
 	unsigned long flags;
-	bool should_queue_work = false;
+	bool arm = false;
+
+	spin_lock_irqsave(&sampling_lock, flags);
+	if (current_state == STATE_IDLE && !windows[window_gen % SAMPLE_BUFFERS].busy) {
+		current_state = STATE_ARMED;
+		next_crossed = ktime_get_ns();
+		arm = true;
+	}
+	spin_unlock_irqrestore(&sampling_lock, flags);
+
+	if (arm)
+		queue_state_work();
+}
+
+void llc_event_wq_callback(struct work_struct *work)
+{
+	unsigned long flags;
+	struct sample_window *closed = NULL;
+	bool sample = false;
+	bool armed = false;
+	u64 now;
 
 	spin_lock_irqsave(&sampling_lock, flags);
 	switch (current_state) {
 		case STATE_SAMPLING: {
 			/* stop sampling */
-			for_each_online_cpu(cpu){
-				perf_event_disable(per_cpu(ld_lat_event,cpu));
-				perf_event_disable(per_cpu(precise_str_event,cpu));
-			}
+			closed = close_window();
 			current_state = STATE_IDLE;
-			should_queue_work = true;
 			break;
 		}
-		case STATE_ARMED: {
-			/* update MEM_LOAD_UOPS_MISC_RETIRED_LLC_MISS value */
-			l1D_val = 0;
-			for_each_online_cpu(cpu){
-				l1D_val += perf_event_read_value(per_cpu(l1D_event,cpu), 
-									 &enabled, &running);
+		case STATE_ROLLOVER: {
+			/* keep sampling into the other buffer while this window is analyzed */
+			closed = close_window();
+			if (windows[window_gen % SAMPLE_BUFFERS].busy) {
+				current_state = STATE_IDLE;
+			} else {
+				window_rollover_count++;
+				current_state = STATE_SAMPLING;
+				window_crossed = next_crossed;
+				sample = true;
 			}
+			break;
+		}
+		case STATE_ARMED: {
+			/* log how many times we passed the threshold */
+			L1_count++;
+			current_state = STATE_SAMPLING;
+			window_crossed = next_crossed;
+			sample = true;
+			armed = true;
+			break;
+		}
+		default:
+			break;
+	}
+	spin_unlock_irqrestore(&sampling_lock, flags);
 
-			ld_miss = l1D_val - old_l1D_val;
+	/* no CPU may release its events while they are used */
+	cpus_read_lock();
 
-			// reset samples BEFORE enabling events
-			kfifo_reset(&samples);
-			record_size = 0;
+	/* the sample timer is stopped until the window starts, the misses
+	 * since the previous window set the load/store split */
+	if (armed && llc_overflow_trigger)
+		miss_total = monitor_read_llc_misses();
 
-			/* Sample loads, stores or both based on LLC load miss count */
-			if(ld_miss >= (miss_total*9)/10){
-				for_each_online_cpu(cpu){
-					perf_event_enable(per_cpu(ld_lat_event,cpu));//sample loads only
-				}
-			}
+	/* perf_event_enable/disable may sleep, apply outside the lock */
+	if (sample)
+		start_sampling();
+	else if (closed)
+		stop_sampling();
 
-			else if(ld_miss < miss_total/10){
-				for_each_online_cpu(cpu){
-					perf_event_enable(per_cpu(precise_str_event,cpu));//sample stores only
-				}
-			}
+	cpus_read_unlock();
+
+	/* fit the sample periods to the interrupt budget for the next window */
+	now = ktime_get_ns();
+	if (closed)
+		sample_periods_tune(now - window_start);
+	if (sample)
+		window_start = now;
+
+	/* without polling the sample timer only runs while sampling */
+	if (armed && llc_overflow_trigger)
+		hrtimer_start(&sample_timer, ktime_set(0, sample_timer_period), HRTIMER_MODE_REL);
+
+	if (closed)
+		queue_window_work(closed);
+}
+
+static bool rows_two_apart(const struct dram_coords *a, const struct dram_coords *b)
+{
+	return dram_same_bank(a, b) && (a->row == b->row + 2 || b->row == a->row + 2);
+}
 
-			else{
-				for_each_online_cpu(cpu){
-					/* sample both */
-					perf_event_enable(per_cpu(ld_lat_event,cpu));
-					perf_event_enable(per_cpu(precise_str_event,cpu));
-				}			
+/* Row aggregation: a row is an aggressor once its activity reaches
+ * @aggressor_misses. Two rows of a bank that are two rows apart hammer the
+ * row in between together, so they only need to reach it together.
+ * Victims of all aggressor rows are refreshed once. Returns the number of
+ * aggressor rows. */
+static unsigned int check_aggressor_rows(u64 aggressor_misses)
+{
+	struct dram_coords rows[PROFILE_N];
+	u64 activity[PROFILE_N];
+	bool hammer[PROFILE_N];
+	unsigned int rec, other, n = 0;
+	u64 pair;
+
+	for(rec = 0;rec<record_size;rec++){
+		dram_row_from_key(profile[rec].phy_page, &rows[rec]);
+		activity[rec] = profile[rec].activity;
+		hammer[rec] = activity[rec] >= aggressor_misses;
+	}
+
+	/* double-sided pairs, both rows carry the activity of the pair */
+	for(rec = 0;rec<record_size;rec++){
+		for(other = rec + 1;other<record_size;other++){
+			pair = (u64)profile[rec].activity + profile[other].activity;
+			if(rows_two_apart(&rows[rec], &rows[other]) && pair >= aggressor_misses){
+				hammer[rec] = true;
+				hammer[other] = true;
+				activity[rec] = max(activity[rec], pair);
+				activity[other] = max(activity[other], pair);
+				double_sided_count++;
 			}
+		}
+	}
 
+	for(rec = 0;rec<record_size;rec++){
+#ifdef DEBUG
+		profile[rec].hammer = hammer[rec];
+#endif
+		if(hammer[rec]){
+			L2_count++;
+			activity[n] = activity[rec];
+			rows[n++] = rows[rec];
+		}
+	}
 
-			/* log how many times we passed the threshold */
-			L1_count++;
-			current_state = STATE_SAMPLING;
-			break;
+	/* a victim shared by a pair is refreshed once */
+	if(n)
+		refresh_aggressor_rows(rows, activity, n);
+
+	return n;
+}
+
+/* A sample of the window on @pfn, it tells who maps the page and where */
+static sample_t *aggressor_sample(unsigned long pfn, size_t sample_total)
+{
+	size_t i;
+
+	for (i = 0; i < sample_total; i++) {
+		if ((window_samples[i].phy_page >> PAGE_SHIFT) == pfn)
+			return &window_samples[i];
+	}
+	return NULL;
+}
+
+/* Only used from the action work item, which never runs concurrently */
+static struct dram_coords para_rows[REFRESH_AGGRESSORS_MAX];
+
+/* PARA mode: refresh the neighbour rows of every sample of the window,
+ * no profile is built. The samples wait in the rings until the window
+ * closes, so a refresh lags its access by up to one window. */
+static void para_refresh(size_t sample_total)
+{
+	struct dram_coords *rows = para_rows;
+	unsigned int n = 0;
+	size_t i;
+	u64 start = ktime_get_ns();
+
+	translate_samples(sample_total);
+
+	for (i = 0; i < sample_total; i++) {
+		if (!(window_samples[i].phy_page >> PAGE_SHIFT))
+			continue;
+
+		if (!dram_def->decode_phys(window_samples[i].phy_page, &rows[n]))
+			continue;
+		n++;
+		para_sample_count++;
+		if (n == REFRESH_AGGRESSORS_MAX) {
+			para_refresh_count += refresh_aggressor_rows(rows, NULL, n);
+			n = 0;
 		}
-		default:
-			break;
 	}
-	spin_unlock_irqrestore(&sampling_lock, flags);
+	if (n)
+		para_refresh_count += refresh_aggressor_rows(rows, NULL, n);
 
-	if (should_queue_work)
-		queue_work(action_wq, &task);
+	para_time_ns += ktime_get_ns() - start;
+}
 
-	old_l1D_val = l1D_val;
+/* A window refreshed victims: compare the time since its threshold
+ * crossing with the target */
+static void account_refresh_latency(struct sample_window *win)
+{
+	u64 latency = ktime_get_ns() - win->crossed;
+	u64 target = (u64)READ_ONCE(refresh_latency_target_us) * NSEC_PER_USEC;
+
+	refresh_latency_ns = latency;
+	if (latency > refresh_latency_max_ns)
+		refresh_latency_max_ns = latency;
+	/* refreshes that arrive late protect nothing */
+	if (target && latency > target)
+		latency_violation_count++;
 }
 
+/* dram_mapping_gen the activity table was keyed with */
+static unsigned long activity_mapping_gen;
+
 /* look at sample profile and take action */
-void action_wq_callback( struct work_struct *work)
+static void analyze_window(struct sample_window *win)
 {
 	int rec,log_;
-	unsigned long pfn1,pfn2;
-	unsigned long *virt;
     size_t sample_total;
-
-	struct page *pg1,*pg2;
-	int i;
+	unsigned long flags, dropped;
+	unsigned long refreshed = refresh_count;
+	u64 misses, aggressor_misses, now, start;
+	unsigned long mapping_gen;
+	sample_t *sample;
 		
-    /* NOTE: Any operations here do NOT need to lock samples_lock:
-     * This workqueue is only queued after sampling is stopped,
-     * so no other code is adding to the samples kfifo at this time. */
-
-	/* Get number of samples before consuming them */
-	sample_total = kfifo_len(&samples);
+    /* NOTE: The per-CPU rings are single-producer/single-consumer,
+     * action_wq (or the detection thread) runs one window at a time, so
+     * this is their only consumer. */
+
+	/* merge the samples of all CPUs */
+	sample_total = sample_rings_drain(win->buf, win->gen, window_samples, window_capacity,
+					  &dropped);
+	trace_anvil_window_close(win->gen, win->miss_total, sample_total, dropped);
+
+	if (para_mode) {
+		para_refresh(sample_total);
+		goto done;
+	}
+	start = ktime_get_ns();
 
-	/* group samples based on physical pages */
+	/* group samples based on physical pages,
+	address with highest number of samples first */
 	build_profile(sample_total);
-	/* sort profile, address with highest number
-	of samples first */
-    sort(profile,record_size,sizeof(profile_t),profile_compare,NULL);
+
+	/* switch between CPU-wide and per-task sampling for the next windows */
+	task_targets_update(window_samples, sample_total, win->per_task);
+
+	/* a page is an aggressor once its misses, summed over the recent
+	 * windows with decay, reach this share of the miss threshold */
+	aggressor_misses = (u64)llc_miss_threshold * aggressor_threshold_percentage / 100;
+	now = ktime_get_ns();
+
+	/* row keys of a replaced DRAM mapping name other rows */
+	mapping_gen = READ_ONCE(dram_mapping_gen);
+	if (row_aggregation && activity_mapping_gen != mapping_gen) {
+		activity_table_reset();
+		activity_mapping_gen = mapping_gen;
+	}
+
+	/* a page caused its share of the window's samples of the window's misses */
+	for(rec = 0;rec<record_size;rec++){
+		misses = div64_u64((u64)profile[rec].llc_total_miss * win->miss_total, sample_total);
+		profile[rec].activity = activity_update(profile[rec].phy_page, misses, now);
+	}
 
 #ifdef DEBUG
 	log_=0;
 #endif
-	if(miss_total > llc_miss_threshold){//if still  high miss
+	if(win->miss_total > llc_miss_threshold){//if still  high miss
 #ifdef DEBUG
 		printk("samples = %lu\n",sample_total);
 #endif
 	/* calculate hammer threshold */
-        hammer_threshold = (llc_miss_threshold*sample_total)/miss_total;
+        hammer_threshold = div64_u64((u64)llc_miss_threshold*sample_total, win->miss_total);
+
+        /* pages above samples/entries are never evicted from the profile,
+         * flag windows where an aggressor could sit below that bound */
+        if ((u64)hammer_threshold * aggressor_threshold_percentage / 100 * profile_table_size() < sample_total)
+            profile_undersized_count++;
 
-        /* check for potential agressors */
-        for(rec = 0;rec<record_size;rec++){
+        trace_anvil_profile(profile, record_size, hammer_threshold, aggressor_misses);
+
+        if(row_aggregation){
+            /* aggressor rows and pairs */
+            if(check_aggressor_rows(aggressor_misses)){
+#ifdef DEBUG
+                log_ = 1;
+#endif
+            }
+        } else {
+            /* check for potential agressors */
+            for(rec = 0;rec<record_size;rec++){
 #ifdef DEBUG
-            profile[rec].hammer = 0;
+                profile[rec].hammer = 0;
 #endif
-            if((profile[rec].llc_total_miss >= (hammer_threshold * aggressor_threshold_percentage) / 100) && (sample_total >= MIN_SAMPLES)){
-				L2_count++;
+                if((profile[rec].activity >= aggressor_misses) && (sample_total >= MIN_SAMPLES)){
+                    L2_count++;
 #ifdef DEBUG
-                log_ = 1;
-                profile[rec].hammer = 1;
-                printk("anvil: Potential hammering detected on page %lu with %lu misses\n",
-                        profile[rec].phy_page,profile[rec].llc_total_miss);
+                    log_ = 1;
+                    profile[rec].hammer = 1;
+                    printk("anvil: Potential hammering detected on page %lu with %lu misses\n",
+                            profile[rec].phy_page,profile[rec].llc_total_miss);
 #endif
-                /* potential hammering detected , deploy refresh */
-                for(i=1;i<=REFRESHED_ROWS;i++){
-                    /* get page frame number for pages in rows above and below */
-                    pfn1 = dram_def->get_row_plus(profile[rec].phy_page,i);
-                    pfn2 = dram_def->get_row_minus(profile[rec].phy_page,i);
-
-                    /* map pages to kernel space and refresh 
-                     * ensure page is not reserved or offline
-                    */
-                    pg1 = pfn_to_online_page(pfn1);
-                    if(pg1 && !PageReserved(pg1)) {
-                        virt = (unsigned long*)kmap(pg1);
-                        if(virt){
-                            asm volatile("clflush (%0)"::"r"(virt):"memory");
-                            profile[rec].dummy1 = READ_ONCE(*virt);
-                            kunmap(pg1);
-                        }
-                    }
-
-                    pg2 = pfn_to_online_page(pfn2);
-                    if(pg2 && !PageReserved(pg2)) {
-                        virt = (unsigned long*)kmap(pg2);
-                        if(virt){
-                            asm volatile("clflush (%0)"::"r"(virt):"memory");
-                            profile[rec].dummy2 = READ_ONCE(*virt);
-                            kunmap(pg2);
-                        }
-                    }
-
-					// We count each refresh in refresh_count, the row above and below.
-					refresh_count += 2;
+                    /* the victims took this window's activations, they are
+                     * refreshed even if the page is moved now */
+                    sample = aggressor_sample(profile[rec].phy_page, sample_total);
+                    if (sample)
+                        migrate_aggressor(profile[rec].phy_page, sample->tid,
+                                          sample->virt_addr);
+
+                    /* potential hammering detected , deploy refresh.
+                     * Each refreshed victim row is counted in refresh_count */
+                    refresh_victims(profile[rec].phy_page, profile[rec].activity);
                 }
-
             }
         }
     }
@@ -377,8 +1123,6 @@ void action_wq_callback( struct work_struct *work)
 		for(rec = 0;rec<record_size;rec++){
 			log[log_index].profile[rec].phy_page = profile[rec].phy_page;
 			log[log_index].profile[rec].llc_percent_miss = profile[rec].llc_percent_miss;
-			log[log_index].profile[rec].dummy1 = profile[rec].dummy1;
-			log[log_index].profile[rec].dummy2 = profile[rec].dummy2;
 			log[log_index].profile[rec].hammer = profile[rec].hammer;
 		}
 		log[log_index].record_size = record_size;
@@ -388,98 +1132,241 @@ void action_wq_callback( struct work_struct *work)
 			log_index = 24999;
 	}
 #endif
+
+	detect_time_ns += ktime_get_ns() - start;
+
+done:
+	if (refresh_count != refreshed)
+		account_refresh_latency(win);
+
+	/* the buffer can take a new window */
+	spin_lock_irqsave(&sampling_lock, flags);
+	win->busy = false;
+	spin_unlock_irqrestore(&sampling_lock, flags);
 	return;
 }
 
+void action_wq_callback( struct work_struct *work)
+{
+	analyze_window(container_of(work, struct sample_window, work));
+}
+
+static void action_kwork_callback(struct kthread_work *work)
+{
+	analyze_window(container_of(work, struct sample_window, kwork));
+}
+
+static void llc_event_kwork_callback(struct kthread_work *work)
+{
+	llc_event_wq_callback(NULL);
+}
+
+/* Thread @name at SCHED_FIFO @priority (0 for SCHED_NORMAL), on
+ * detect_kthread_cpus */
+static struct kthread_worker *detect_thread_create(const char *name, int priority)
+{
+	struct sched_attr attr = {
+		.size = sizeof(attr),
+		.sched_policy = SCHED_FIFO,
+		.sched_priority = priority,
+	};
+	struct kthread_worker *worker;
+	cpumask_var_t mask;
+	int ret = 0;
+
+	worker = kthread_create_worker(0, name);
+	if (IS_ERR(worker))
+		return worker;
+
+	if (priority > 0) {
+		ret = sched_setattr_nocheck(worker->task, &attr);
+		if (ret) {
+			printk(KERN_ERR "anvil: invalid detection thread priority %d\n", priority);
+			goto err;
+		}
+	}
+
+	if (detect_kthread_cpus && *detect_kthread_cpus) {
+		if (!zalloc_cpumask_var(&mask, GFP_KERNEL)) {
+			ret = -ENOMEM;
+			goto err;
+		}
+		ret = cpulist_parse(detect_kthread_cpus, mask);
+		if (!ret)
+			ret = set_cpus_allowed_ptr(worker->task, mask);
+		free_cpumask_var(mask);
+		if (ret) {
+			printk(KERN_ERR "anvil: invalid detection thread CPU list %s\n", detect_kthread_cpus);
+			goto err;
+		}
+	}
+
+	return worker;
+
+err:
+	kthread_destroy_worker(worker);
+	return ERR_PTR(ret);
+}
+
+static void detect_worker_stop(void)
+{
+	if (state_worker)
+		kthread_destroy_worker(state_worker);
+	if (detect_worker)
+		kthread_destroy_worker(detect_worker);
+	state_worker = NULL;
+	detect_worker = NULL;
+}
+
+/* State and analysis threads with detect_kthread_priority. The state thread
+ * runs one priority above, so it preempts a long analysis on a shared CPU. */
+static int detect_worker_start(void)
+{
+	int priority = detect_kthread_priority;
+	struct kthread_worker *worker;
+
+	worker = detect_thread_create("anvil_state",
+				      priority > 0 ? min(priority + 1, MAX_RT_PRIO - 1) : 0);
+	if (IS_ERR(worker))
+		return PTR_ERR(worker);
+	state_worker = worker;
+
+	worker = detect_thread_create("anvil_detect", priority);
+	if (IS_ERR(worker)) {
+		detect_worker_stop();
+		return PTR_ERR(worker);
+	}
+	detect_worker = worker;
+
+	return 0;
+}
+
+/* Next count tick in @period ns. The tick may be deferred by a fraction of
+ * the period so that it coalesces with other wakeups of an idle CPU. */
+static void forward_count_tick(struct hrtimer *timer, unsigned int period)
+{
+	hrtimer_forward_now(timer, ns_to_ktime(period));
+	hrtimer_set_expires_range_ns(timer, hrtimer_get_softexpires(timer),
+								 period >> TIMER_SLACK_SHIFT);
+}
+
+/* Double the count period while @misses (scaled to count_timer_period) stay
+ * far below the threshold, back to the fast period as soon as they rise */
+static unsigned int backoff_count_period(u64 misses)
+{
+	unsigned int max_period = READ_ONCE(count_timer_max_period);
+
+	if (misses * BACKOFF_MISS_DIVISOR >= llc_miss_threshold || max_period <= count_timer_period)
+		return count_timer_period;
+
+	return min_t(u64, (u64)count_period_current * 2, max_period);
+}
+
 /* Timer interrupt handler */
 enum hrtimer_restart timer_callback( struct hrtimer *timer )
 {
 	ktime_t now;
-	u64 enabled,running;
-	int cpu;
 	unsigned long flags;
+	bool restart = true;
+	unsigned int period = count_period_current;
+	u64 misses;
         
-    /* Update llc miss counter value */
-	val = 0;
-	for_each_online_cpu(cpu){
-    	val += perf_event_read_value(per_cpu(llc_event,cpu), &enabled, &running);
+    /* LLC misses since the previous tick */
+	miss_total = monitor_read_llc_misses();
+
+	spin_lock_irqsave(&sampling_lock, flags);
+	if(current_state == STATE_SAMPLING && miss_total > llc_miss_threshold &&
+	   !windows[(window_gen + 1) % SAMPLE_BUFFERS].busy){
+		/* still hammering, go on sampling without a monitoring period */
+		current_state = STATE_ROLLOVER;
+		next_crossed = ktime_get_ns();
+		ktime = ktime_set(0,sample_timer_period);
+		now = hrtimer_cb_get_time(timer); 
+		hrtimer_forward(&sample_timer,now,ktime);
+		/* windows end on time, no slack */
+		hrtimer_set_expires(timer, hrtimer_get_softexpires(timer));
 	}
 
-	miss_total = val - old_val;
-	old_val = val;
+	else if(current_state == STATE_IDLE && !llc_overflow_trigger){
+		/* misses at the fast cadence, the last tick may have been backed off */
+		misses = div_u64(miss_total * count_timer_period, max(count_period_current, 1U));
 
-	spin_lock_irqsave(&sampling_lock, flags);
-	if(current_state == STATE_IDLE){
-	/* Start sampling if miss rate is high */
-		if(miss_total > llc_miss_threshold){
+	/* Start sampling if miss rate is high and the buffer is free */
+		if(misses > llc_miss_threshold && !windows[window_gen % SAMPLE_BUFFERS].busy){
 			current_state = STATE_ARMED;
+			next_crossed = ktime_get_ns();
+			count_period_current = count_timer_period;
 			/* set next interrupt interval for sampling */
 			ktime = ktime_set(0,sample_timer_period);
       		now = hrtimer_cb_get_time(timer); 
       		hrtimer_forward(&sample_timer,now,ktime);
+			hrtimer_set_expires(timer, hrtimer_get_softexpires(timer));
 		}
 
 		else{
 			/* set next interrupt interval for counting */
-			ktime = ktime_set(0,count_timer_period);
-     		now = hrtimer_cb_get_time(timer); 
-      		hrtimer_forward(&sample_timer,now,ktime);
+			count_period_current = backoff_count_period(misses);
+			forward_count_tick(timer, count_period_current);
 		}
 	}
 
+	else if(llc_overflow_trigger){
+		/* window is over (or was never started), the next one is armed
+		 * by an LLC overflow */
+		restart = false;
+	}
+
 	else{
-		ktime = ktime_set(0,count_timer_period);
-     	now = hrtimer_cb_get_time(timer); 
-      	hrtimer_forward(&sample_timer,now,ktime);
+		count_period_current = count_timer_period;
+		forward_count_tick(timer, count_period_current);
 	}
+	trace_anvil_monitor_tick(miss_total, llc_miss_threshold, count_period_current,
+				 current_state != STATE_IDLE);
 	spin_unlock_irqrestore(&sampling_lock, flags);
+
+	/* the local timers still tick at the backed-off period */
+	if (count_period_current < period)
+		monitor_snap_back();
 				
 	/* start task that analyzes llc misses */
-	queue_work(llc_event_wq, &task2);
+	queue_state_work();
 
 	/* restart timer */
-   	return HRTIMER_RESTART;
+   	return restart ? HRTIMER_RESTART : HRTIMER_NORESTART;
 }
 
 /* Groups samples accoriding to accessed physical pages */
 static void build_profile(size_t sample_total)
 {
-	int rec;
-	sample_t sample;
+	size_t i;
 	unsigned long phy_page;
+	struct dram_coords coords;
+
+	translate_samples(sample_total);
 
-	while (kfifo_get(&samples, &sample)) {
-		phy_page = sample_to_pfn(&sample); 
+	profile_table_reset();
+	for (i = 0; i < sample_total; i++) {
+		phy_page = window_samples[i].phy_page >> PAGE_SHIFT;
 		if (!phy_page) {
 			continue;
 		}
 
-		/* see if page already exists in profile */
-		for (rec = 0; rec < record_size; rec++) {
-			if (profile[rec].phy_page == phy_page) {
-				profile[rec].llc_total_miss++;
-				profile[rec].cpu = sample.cpu;
-				break;
-			}
-		}
-
-		if (rec == record_size) {
-			/* new entry */
-			if (record_size < PROFILE_N) {
-				profile[record_size].phy_page = phy_page;
-				profile[record_size].llc_total_miss = 1;
-				profile[record_size].cpu = sample.cpu;
-				record_size++;
-			} else {
-				/* overwrite last entry if full */
-				profile[PROFILE_N - 1].phy_page = phy_page;
-				profile[PROFILE_N - 1].llc_total_miss = 1;
-				profile[PROFILE_N - 1].cpu = sample.cpu;
-			}
+		/* all pages of a row count for the row */
+		if (row_aggregation) {
+			if (!dram_def->decode_phys(window_samples[i].phy_page, &coords))
+				continue;
+			profile_table_add(dram_row_key(&coords), window_samples[i].cpu);
+		} else {
+			profile_table_add(phy_page, window_samples[i].cpu);
 		}
 	}
+
+	/* only the heaviest PROFILE_N pages are considered */
+	record_size = profile_table_top(profile, PROFILE_N);
+
 #ifdef DEBUG
 	if (sample_total > 0) {
+		unsigned int rec;
 		for(rec=0;rec<record_size;rec++){
 			profile[rec].llc_percent_miss = (profile[rec].llc_total_miss*100)/sample_total;
 		}
@@ -487,14 +1374,80 @@ static void build_profile(size_t sample_total)
 #endif
 }
 
-/* Sort addresses with higest address distribution first */
-static int profile_compare(const void *a, const void *b)
+/* Create a sampling event on @cpu with @period */
+static struct perf_event *create_sampling_event(struct perf_event_attr *attr, u64 period, int cpu,
+											   perf_overflow_handler_t callback)
+{
+	struct perf_event_attr cpu_attr = *attr;
+
+	cpu_attr.sample_period = period;
+	return perf_event_create_kernel_counter(&cpu_attr, cpu, NULL, callback, NULL);
+}
+
+static void release_event(struct perf_event *event)
+{
+	if (event) {
+		perf_event_disable(event);
+		perf_event_release_kernel(event);
+	}
+}
+
+/* CPU came online: count its LLC and load misses. The sampling events are
+ * only created once the CPU samples. */
+static int anvil_cpu_online(unsigned int cpu)
 {
-    profile_t *prof_a = (profile_t *)a;
-    profile_t *prof_b = (profile_t *)b;
+	struct perf_event *llc, *l1D;
+
+	llc = perf_event_create_kernel_counter(&llc_miss_event, cpu, NULL, llc_event_callback, NULL);
+	if (IS_ERR(llc)) {
+		printk(KERN_ERR "anvil: failed to create llc event on CPU %u\n", cpu);
+		return PTR_ERR(llc);
+	}
+
+	l1D = perf_event_create_kernel_counter(&l1D_miss_event, cpu, NULL, l1D_event_callback, NULL);
+	if (IS_ERR(l1D)) {
+		printk(KERN_ERR "anvil: failed to create l1D miss event on CPU %u\n", cpu);
+		release_event(llc);
+		return PTR_ERR(l1D);
+	}
+
+	/* start counting */
+	perf_event_enable(llc);
+	perf_event_enable(l1D);
+
+	monitor_cpu_online(cpu);
+	WRITE_ONCE(per_cpu(llc_event, cpu), llc);
+	WRITE_ONCE(per_cpu(l1D_event, cpu), l1D);
 
-    // NOTE: sorting by total LLC misses
-    return prof_b->llc_total_miss - prof_a->llc_total_miss;
+	return 0;
+}
+
+/* CPU goes offline: stop monitoring it and release all of its events */
+static int anvil_cpu_offline(unsigned int cpu)
+{
+	struct perf_event *llc, *l1D;
+
+	monitor_cpu_offline(cpu);
+
+	llc = per_cpu(llc_event, cpu);
+	l1D = per_cpu(l1D_event, cpu);
+	WRITE_ONCE(per_cpu(llc_event, cpu), NULL);
+	WRITE_ONCE(per_cpu(l1D_event, cpu), NULL);
+	/* the monitor timer reads the counters from interrupt context */
+	synchronize_rcu();
+
+	release_event(llc);
+	release_event(l1D);
+
+	/* sampling events, if the CPU ever sampled */
+	release_event(per_cpu(ld_lat_event, cpu));
+	release_event(per_cpu(precise_str_event, cpu));
+	per_cpu(ld_lat_event, cpu) = NULL;
+	per_cpu(precise_str_event, cpu) = NULL;
+	per_cpu(sampling_events, cpu) = 0;
+	cpumask_clear_cpu(cpu, &sampling_cpus);
+
+	return 0;
 }
 
 /* Initialize module */
@@ -502,6 +1455,7 @@ static int start_init(void)
 {
 	int cpu;
     int ret;
+	int i;
 
     llc_miss_event = (struct perf_event_attr){
         .type = PERF_TYPE_HARDWARE,
@@ -511,6 +1465,13 @@ static int start_init(void)
         .pinned = 1,
     };
 
+    if (llc_overflow_trigger) {
+        /* LLC_OVERFLOW_SLICES overflows per llc_miss_threshold misses on a CPU */
+        llc_miss_event.sample_period = max(llc_miss_threshold / LLC_OVERFLOW_SLICES, 1U);
+        /* counters are read during windows only, no timers while idle */
+        percpu_monitor = false;
+    }
+
     l1D_miss_event = (struct perf_event_attr){
         .type = PERF_TYPE_RAW,
         .config = MEM_LOAD_UOPS_MISC_RETIRED_LLC_MISS,
@@ -546,84 +1507,133 @@ static int start_init(void)
         .pinned = 1,
     };
 
-    INIT_KFIFO(samples);
+	/* per-CPU sample rings and the buffer they are merged into */
+	ret = sample_rings_init(sample_ring_size());
+	if (ret) {
+		printk(KERN_ERR "anvil: failed to allocate sample rings\n");
+		goto err_rings;
+	}
+
+	window_capacity = min_t(size_t, (size_t)num_possible_cpus() * sample_ring_capacity(),
+							SAMPLES_MERGE_MAX);
+	window_samples = kvmalloc_array(window_capacity, sizeof(sample_t), GFP_KERNEL);
+	if (!window_samples) {
+		printk(KERN_ERR "anvil: failed to allocate sample window\n");
+		ret = -ENOMEM;
+		goto err_rings;
+	}
+
+	ret = profile_table_init(profile_table_entries);
+	if (ret) {
+		printk(KERN_ERR "anvil: failed to allocate profile table\n");
+		goto err_samples;
+	}
+
+	ret = activity_table_init(activity_table_entries);
+	if (ret) {
+		printk(KERN_ERR "anvil: failed to set up activity table\n");
+		goto err_profile;
+	}
 
 	/* insert sysfs entry */
 	ret = anvil_sysfs_init();
 	if (ret) {
 		printk(KERN_ERR "anvil: failed to initialize sysfs interface\n");
-		return ret;
+		goto err_activity;
 	}
 
     ret = detect_and_register_dram_mapping();
     if(ret){
             printk(KERN_ERR "Error detecting DRAM mapping\n");
-            return ret;
+            goto err_sysfs;
     }
 
-	old_val = 0;
-	/* Setup LLC Miss event */
-	for_each_online_cpu(cpu){
-   		per_cpu(llc_event, cpu) = perf_event_create_kernel_counter(&llc_miss_event, cpu,
-                 NULL,llc_event_callback,NULL);
-   	 	if(IS_ERR(per_cpu(llc_event, cpu))){
-        	printk("Error creating llc event.\n");
-        	return 0;
-    	}				
-		/* start counting */
-		perf_event_enable(per_cpu(llc_event, cpu));
-	}
-
-	old_l1D_val = 0;
-	/* setup LLC Miss event */
-	for_each_online_cpu(cpu){
-   		per_cpu(l1D_event, cpu) = perf_event_create_kernel_counter(&l1D_miss_event, cpu,
-                 NULL,l1D_event_callback,NULL);
-   	 	if(IS_ERR(per_cpu(l1D_event, cpu))){
-        	printk("Error creating l1D miss event.\n");
-        	return 0;
-    	}
-						
-		/* start counting */
-		perf_event_enable(per_cpu(l1D_event, cpu));
-	}
-
-	/* setup load latency event */
-	for_each_online_cpu(cpu){
-   		per_cpu(ld_lat_event, cpu) = perf_event_create_kernel_counter(&load_latency_event, cpu,
-                 													NULL,load_latency_callback,NULL);
-   	 	if(IS_ERR(per_cpu(ld_lat_event, cpu))){
-        	printk("Error creating load latency event.\n");
-        	return 0;
-    	}
+	/* node-local refresh workers */
+	ret = refresh_init(detect_kthread);
+	if (ret) {
+		printk(KERN_ERR "anvil: failed to set up refresh workers\n");
+		goto err_mapping;
 	}
 
-	/* setup precise store event */
-	for_each_online_cpu(cpu){
-   		per_cpu(precise_str_event, cpu) = perf_event_create_kernel_counter(&precise_str_event_attr, cpu,
-                 															NULL,precise_str_callback,NULL);
-   	 	if(IS_ERR(per_cpu(precise_str_event, cpu))){
-        	printk("Error creating precise store event.\n");
-        	return 0;
-    	}
+	/* initialize work queue, windows are analyzed one at a time */
+	action_wq = alloc_ordered_workqueue("action_queue", 0);
+	if (!action_wq) {
+		ret = -ENOMEM;
+		goto err_refresh;
+	}
+	for (i = 0; i < SAMPLE_BUFFERS; i++) {
+		windows[i].buf = i;
+		INIT_WORK(&windows[i].work, action_wq_callback);
+		kthread_init_work(&windows[i].kwork, action_kwork_callback);
 	}
-
-	/* setup Timer */
-    ktime = ktime_set(0,count_timer_period);
-    hrtimer_init(&sample_timer,CLOCK_REALTIME,HRTIMER_MODE_REL);
-    sample_timer.function = &timer_callback;
-    hrtimer_start(&sample_timer,ktime,HRTIMER_MODE_REL);
-     
-	/* initialize work queue */
-	action_wq = create_workqueue("action_queue");
-	INIT_WORK(&task, action_wq_callback);
 
 	llc_event_wq = create_workqueue("llc_event_queue");
+	if (!llc_event_wq) {
+		ret = -ENOMEM;
+		goto err_action_wq;
+	}
 	INIT_WORK(&task2, llc_event_wq_callback);
+	kthread_init_work(&task2_kwork, llc_event_kwork_callback);
+
+	/* the pipeline on dedicated threads, ahead of ordinary kworkers */
+	if (detect_kthread) {
+		ret = detect_worker_start();
+		if (ret)
+			goto err_llc_wq;
+	}
+
+	init_irq_work(&llc_trigger_work, llc_trigger_callback);
+
+	/* xorshift state must not be zero */
+	for_each_possible_cpu(cpu)
+		per_cpu(para_seed, cpu) = get_random_u32() | 1;
+
+	/* setup Timer, it polls the LLC counters unless overflows arm sampling */
+    hrtimer_init(&sample_timer,CLOCK_MONOTONIC,HRTIMER_MODE_REL);
+    sample_timer.function = &timer_callback;
+
+	/* counting events on every online CPU and on CPUs brought up later,
+	 * rolled back on all CPUs if one of them fails */
+	ret = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN, "anvil:online",
+							anvil_cpu_online, anvil_cpu_offline);
+	if (ret < 0) {
+		printk(KERN_ERR "anvil: failed to set up CPU hotplug state\n");
+		goto err_worker;
+	}
+	anvil_cpuhp_state = ret;
+
+    count_period_current = count_timer_period;
+    if (!llc_overflow_trigger) {
+        ktime = ktime_set(0,count_timer_period);
+        hrtimer_start_range_ns(&sample_timer,ktime,count_timer_period >> TIMER_SLACK_SHIFT,
+                               HRTIMER_MODE_REL);
+    }
 
 	printk("done initializing\n");
   	
    	return 0;
+
+err_worker:
+	detect_worker_stop();
+err_llc_wq:
+	destroy_workqueue(llc_event_wq);
+err_action_wq:
+	destroy_workqueue(action_wq);
+err_refresh:
+	refresh_exit();
+err_mapping:
+	unregister_dram_mapping();
+err_sysfs:
+	anvil_sysfs_exit();
+err_activity:
+	activity_table_exit();
+err_profile:
+	profile_table_exit();
+err_samples:
+	kvfree(window_samples);
+err_rings:
+	sample_rings_exit();
+	return ret;
 }
 
 /* Cleanup module */
@@ -633,45 +1643,42 @@ static void finish_exit(void)
     /* timer */
     ret = hrtimer_cancel(&sample_timer);
 
-    /* llc_event */
-	for_each_online_cpu(cpu){
-    	if(per_cpu(llc_event, cpu)){
-    		perf_event_disable(per_cpu(llc_event, cpu));
-       		perf_event_release_kernel(per_cpu(llc_event, cpu));
-    	}
-	}
-
-	/* l1D_event */
-	for_each_online_cpu(cpu){
-    	if(per_cpu(l1D_event, cpu)){
-    		perf_event_disable(per_cpu(l1D_event, cpu));
-        	perf_event_release_kernel(per_cpu(l1D_event, cpu));
-    	}
+	if (llc_overflow_trigger) {
+		/* no new triggers, then stop a timer started by a pending arm */
+		cpus_read_lock();
+		for_each_online_cpu(cpu){
+			if(per_cpu(llc_event, cpu))
+				perf_event_disable(per_cpu(llc_event, cpu));
+		}
+		cpus_read_unlock();
+		irq_work_sync(&llc_trigger_work);
+		flush_state_work();
+		hrtimer_cancel(&sample_timer);
 	}
 
-	/* load latency event */
-	for_each_online_cpu(cpu){
-    	if(per_cpu(ld_lat_event, cpu)){
-        	perf_event_disable(per_cpu(ld_lat_event, cpu));
-        	perf_event_release_kernel(per_cpu(ld_lat_event, cpu));
-    	}
-	}
+	/* no state transition may touch the events once they are released */
+	flush_state_work();
+  	destroy_workqueue(llc_event_wq);
 
-	/* precise store event */
-	for_each_online_cpu(cpu){
-    	if(per_cpu(precise_str_event, cpu)){
-    		perf_event_disable(per_cpu(precise_str_event, cpu));
-        	perf_event_release_kernel(per_cpu(precise_str_event, cpu));
-   		 }
-	}
+	/* runs the offline callback on every CPU, releasing all events */
+	cpuhp_remove_state(anvil_cpuhp_state);
 
 	flush_workqueue(action_wq);
   	destroy_workqueue(action_wq);
-	flush_workqueue(llc_event_wq);
-  	destroy_workqueue(llc_event_wq);
+	/* analysis of the last windows */
+	detect_worker_stop();
+	refresh_exit();
+	task_targets_exit();
 	/* remove sysfs entry */
 	anvil_sysfs_exit();
 
+	unregister_dram_mapping();
+
+	activity_table_exit();
+	profile_table_exit();
+	sample_rings_exit();
+	kvfree(window_samples);
+
 #ifdef DEBUG
 	/* Log of ANVIL. CSV of some of the sampled/detected addresses */
 			 
@@ -685,10 +1692,8 @@ static void finish_exit(void)
 		}
 
 		for(j=0; j<4; j++){
-			/* Values read form row above and row below */
+			/* pages flagged as aggressors */
 			printk("%d,",log[i].profile[j].hammer);
-			printk("0x%lx,",log[i].profile[j].dummy1);
-			printk("0x%lx,",log[i].profile[j].dummy2);
 		}
 					
 		/* Total samples per sample period */
@@ -0,0 +1,187 @@
+// Aggressor page migration
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/sched/task.h>
+#include <linux/pid.h>
+#include <linux/migrate.h>
+#include <linux/highmem.h>
+#include <linux/hash.h>
+#include <linux/version.h>
+
+#include "anvil.h"
+#include "dram_mapping.h"
+#include "anvil_refresh.h"
+#include "anvil_migrate.h"
+
+/*
+ * An aggressor detected migrate_after times is moved to a physical page in
+ * another bank, or at least out of reach of the victim rows it hammered,
+ * with the migrate_vma helpers. The victims of the old location are
+ * refreshed once more for the detection that moved the page, the process
+ * keeps its virtual address and the rows it used to hammer are left alone.
+ *
+ * The destination starts with no activity. A thread that keeps hammering it
+ * is detected again, its new victims are refreshed like any other, and the
+ * page counts towards another migration.
+ *
+ * Everything runs in action_wq, which is ordered, so the table needs no
+ * locking. It is small and direct mapped, a page that is evicted starts
+ * over.
+ */
+
+#define MIGRATE_TRACK_BITS 8
+#define MIGRATE_DEST_TRIES 8
+
+struct detection {
+	unsigned long pfn;
+	unsigned int count;
+};
+
+static struct detection detections[1 << MIGRATE_TRACK_BITS];
+
+unsigned long migrate_success_count = 0;
+unsigned long migrate_fail_count = 0;
+
+/* Is @dst out of reach of the victims of @src? */
+static bool far_enough(unsigned long src, unsigned long dst)
+{
+	struct dram_coords s, d;
+
+	/* no config covers the destination, its rows are unknown */
+	if (!dram_def->decode(src, &s) || !dram_def->decode(dst, &d))
+		return false;
+
+	if (!dram_same_bank(&s, &d))
+		return true;
+
+	/* same bank, the rows must not share a victim */
+	return (s.row > d.row ? s.row - d.row : d.row - s.row) >
+	       2 * (size_t)READ_ONCE(blast_radius);
+}
+
+/* Allocate a destination for @src on its node, NULL if every try landed
+ * next to it. Rejected pages are held until the end so that the allocator
+ * does not return them again. */
+static struct page *alloc_destination(struct page *src)
+{
+	struct page *tried[MIGRATE_DEST_TRIES];
+	struct page *page, *dst = NULL;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < MIGRATE_DEST_TRIES; i++) {
+		page = alloc_pages_node(page_to_nid(src), GFP_HIGHUSER_MOVABLE | __GFP_NOWARN, 0);
+		if (!page)
+			break;
+		if (far_enough(page_to_pfn(src), page_to_pfn(page))) {
+			dst = page;
+			break;
+		}
+		tried[n++] = page;
+	}
+
+	while (n)
+		__free_page(tried[--n]);
+
+	return dst;
+}
+
+/* Caller holds mmap_read_lock(vma->vm_mm) */
+static bool migrate_page_vma(struct vm_area_struct *vma, unsigned long pfn, unsigned long addr)
+{
+	unsigned long src = 0, dst = 0;
+	struct migrate_vma args = {
+		.vma = vma,
+		.start = addr,
+		.end = addr + PAGE_SIZE,
+		.src = &src,
+		.dst = &dst,
+		.flags = MIGRATE_VMA_SELECT_SYSTEM,
+	};
+	struct page *spage, *dpage;
+	bool migrated;
+
+	if (migrate_vma_setup(&args) || !args.cpages)
+		return false;
+
+	/* the page moved since it was sampled, or cannot be migrated */
+	spage = migrate_pfn_to_page(src);
+	if (!(src & MIGRATE_PFN_MIGRATE) || !spage || page_to_pfn(spage) != pfn)
+		goto out;
+
+	dpage = alloc_destination(spage);
+	if (!dpage)
+		goto out;
+
+	lock_page(dpage);
+	copy_highpage(dpage, spage);
+	dst = migrate_pfn(page_to_pfn(dpage));
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+	dst |= MIGRATE_PFN_LOCKED;
+#endif
+
+	migrate_vma_pages(&args);
+
+out:
+	migrated = dst && (src & MIGRATE_PFN_MIGRATE);
+
+	/* releases the page that is not mapped in the end */
+	migrate_vma_finalize(&args);
+	return migrated;
+}
+
+static bool migrate_page(unsigned long pfn, pid_t tid, unsigned long addr)
+{
+	struct task_struct *task;
+	struct vm_area_struct *vma;
+	struct mm_struct *mm;
+	struct pid *pid;
+	bool migrated = false;
+
+	pid = find_get_pid(tid);
+	task = get_pid_task(pid, PIDTYPE_PID);
+	put_pid(pid);
+	if (!task)
+		return false;
+
+	mm = get_task_mm(task);
+	put_task_struct(task);
+	if (!mm)
+		return false;
+
+	addr &= PAGE_MASK;
+	mmap_read_lock(mm);
+	vma = find_vma(mm, addr);
+	if (vma && vma->vm_start <= addr)
+		migrated = migrate_page_vma(vma, pfn, addr);
+	mmap_read_unlock(mm);
+	mmput(mm);
+
+	return migrated;
+}
+
+bool migrate_aggressor(unsigned long pfn, pid_t tid, unsigned long addr)
+{
+	struct detection *d = &detections[hash_long(pfn, MIGRATE_TRACK_BITS)];
+	unsigned int after = READ_ONCE(migrate_after);
+
+	if (!after)
+		return false;
+
+	if (d->pfn != pfn) {
+		d->pfn = pfn;
+		d->count = 0;
+	}
+	if (++d->count < after)
+		return false;
+
+	d->count = 0;
+	if (!migrate_page(pfn, tid, addr)) {
+		migrate_fail_count++;
+		return false;
+	}
+
+	migrate_success_count++;
+	return true;
+}
@@ -0,0 +1,19 @@
+#ifndef ANVIL_MIGRATE_H
+#define ANVIL_MIGRATE_H
+
+#include <linux/types.h>
+
+/* detections after which an aggressor page is migrated (0 disables) */
+extern unsigned int migrate_after;
+
+/* migration statistics */
+extern unsigned long migrate_success_count;
+extern unsigned long migrate_fail_count;
+
+/* Count a detection of the aggressor @pfn, mapped at @addr by thread @tid.
+ * Once it was detected migrate_after times, move it to a page in another
+ * bank or row neighbourhood. Returns true if the page was migrated, the
+ * victims of @pfn still need this detection's refresh. Called from action_wq. */
+bool migrate_aggressor(unsigned long pfn, pid_t tid, unsigned long addr);
+
+#endif // ANVIL_MIGRATE_H
@@ -0,0 +1,194 @@
+// LLC miss monitoring
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/perf_event.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/irq_work.h>
+
+#include "anvil.h"
+#include "anvil_monitor.h"
+
+/*
+ * In the default mode the monitor timer reads the counters of every online
+ * CPU with perf_event_read_value(), one cross-CPU call per CPU and tick.
+ *
+ * With percpu_monitor, each CPU runs a pinned timer that reads its own
+ * counters with perf_event_read_local() and publishes the values here. The
+ * monitor timer only sums what was published, so its cost no longer depends
+ * on cross-CPU calls. Published values are at most one local period old.
+ */
+struct cpu_monitor {
+	struct hrtimer timer;
+	/* restarts the timer on its CPU when the period snaps back */
+	struct irq_work kick;
+	/* the local timer runs, cleared before it is cancelled */
+	bool active;
+	/* latest counter values, written by the local timer only */
+	u64 llc_count;
+	u64 load_count;
+	/* values at the previous read and the change since the one
+	 * before, owned by the readers */
+	u64 llc_seen;
+	u64 load_seen;
+	u64 llc_delta;
+	u64 load_delta;
+};
+
+static DEFINE_PER_CPU(struct cpu_monitor, cpu_monitors);
+
+/* the local timers must tick at least once per monitor timer tick,
+ * and back off with it */
+static ktime_t monitor_period(void)
+{
+	return ns_to_ktime(min(READ_ONCE(count_period_current), READ_ONCE(sample_timer_period)));
+}
+
+static void read_local(struct perf_event *event, u64 *count)
+{
+	u64 value;
+
+	/* fails if the event is not on this CPU, keep the last value then */
+	if (!IS_ERR_OR_NULL(event) && !perf_event_read_local(event, &value, NULL, NULL))
+		WRITE_ONCE(*count, value);
+}
+
+static enum hrtimer_restart cpu_monitor_callback(struct hrtimer *timer)
+{
+	struct cpu_monitor *mon = container_of(timer, struct cpu_monitor, timer);
+
+	read_local(READ_ONCE(*this_cpu_ptr(&llc_event)), &mon->llc_count);
+	read_local(READ_ONCE(*this_cpu_ptr(&l1D_event)), &mon->load_count);
+
+	hrtimer_forward_now(timer, monitor_period());
+	return HRTIMER_RESTART;
+}
+
+/* runs on the CPU of the monitor */
+static void cpu_monitor_kick(struct irq_work *work)
+{
+	struct cpu_monitor *mon = container_of(work, struct cpu_monitor, kick);
+
+	if (!READ_ONCE(mon->active))
+		return;
+
+	read_local(READ_ONCE(*this_cpu_ptr(&llc_event)), &mon->llc_count);
+	read_local(READ_ONCE(*this_cpu_ptr(&l1D_event)), &mon->load_count);
+
+	/* started from its own CPU, the pinned timer stays there */
+	hrtimer_start(&mon->timer, monitor_period(), HRTIMER_MODE_REL_PINNED);
+}
+
+void monitor_snap_back(void)
+{
+	struct cpu_monitor *mon;
+	int cpu;
+
+	if (!percpu_monitor)
+		return;
+
+	for_each_online_cpu(cpu) {
+		mon = per_cpu_ptr(&cpu_monitors, cpu);
+		if (READ_ONCE(mon->active))
+			irq_work_queue_on(&mon->kick, cpu);
+	}
+}
+
+void monitor_cpu_online(unsigned int cpu)
+{
+	struct cpu_monitor *mon = per_cpu_ptr(&cpu_monitors, cpu);
+
+	/* the new counters start from zero */
+	WRITE_ONCE(mon->llc_count, 0);
+	WRITE_ONCE(mon->load_count, 0);
+	mon->llc_seen = 0;
+	mon->load_seen = 0;
+
+	if (!percpu_monitor)
+		return;
+
+	/* runs on @cpu, the timer is pinned to it */
+	hrtimer_init(&mon->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+	mon->timer.function = cpu_monitor_callback;
+	init_irq_work(&mon->kick, cpu_monitor_kick);
+	hrtimer_start(&mon->timer, monitor_period(), HRTIMER_MODE_REL_PINNED);
+	WRITE_ONCE(mon->active, true);
+}
+
+void monitor_cpu_offline(unsigned int cpu)
+{
+	struct cpu_monitor *mon = per_cpu_ptr(&cpu_monitors, cpu);
+
+	/* no kick may restart the timer once it is cancelled */
+	WRITE_ONCE(mon->active, false);
+	if (mon->timer.function) {
+		irq_work_sync(&mon->kick);
+		hrtimer_cancel(&mon->timer);
+	}
+	WRITE_ONCE(mon->llc_delta, 0);
+	WRITE_ONCE(mon->load_delta, 0);
+}
+
+/* a CPU without counters (going offline) reports no new misses */
+static u64 read_counter(struct perf_event *event, u64 *published, u64 seen)
+{
+	u64 enabled, running;
+
+	if (percpu_monitor)
+		return READ_ONCE(*published);
+	if (!event)
+		return seen;
+	return perf_event_read_value(event, &enabled, &running);
+}
+
+/* a counter recreated by CPU hotplug starts over from zero */
+static u64 counter_delta(u64 value, u64 seen)
+{
+	return value >= seen ? value - seen : value;
+}
+
+u64 monitor_read_llc_misses(void)
+{
+	struct cpu_monitor *mon;
+	u64 value, total = 0;
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		mon = per_cpu_ptr(&cpu_monitors, cpu);
+		value = read_counter(READ_ONCE(per_cpu(llc_event, cpu)), &mon->llc_count,
+				     mon->llc_seen);
+		WRITE_ONCE(mon->llc_delta, counter_delta(value, mon->llc_seen));
+		mon->llc_seen = value;
+		total += mon->llc_delta;
+	}
+
+	return total;
+}
+
+u64 monitor_read_load_misses(void)
+{
+	struct cpu_monitor *mon;
+	u64 value, total = 0;
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		mon = per_cpu_ptr(&cpu_monitors, cpu);
+		value = read_counter(READ_ONCE(per_cpu(l1D_event, cpu)), &mon->load_count,
+				     mon->load_seen);
+		WRITE_ONCE(mon->load_delta, counter_delta(value, mon->load_seen));
+		mon->load_seen = value;
+		total += mon->load_delta;
+	}
+
+	return total;
+}
+
+u64 monitor_cpu_llc_misses(int cpu)
+{
+	return READ_ONCE(per_cpu_ptr(&cpu_monitors, cpu)->llc_delta);
+}
+
+u64 monitor_cpu_load_misses(int cpu)
+{
+	return READ_ONCE(per_cpu_ptr(&cpu_monitors, cpu)->load_delta);
+}
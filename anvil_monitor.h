@@ -0,0 +1,31 @@
+#ifndef ANVIL_MONITOR_H
+#define ANVIL_MONITOR_H
+
+#include <linux/types.h>
+
+/* every CPU reads its own miss counters from a pinned local timer */
+extern bool percpu_monitor;
+
+/* Hotplug callbacks, called on @cpu before its counters are published and
+ * after they were withdrawn. Start and stop the local timer if
+ * percpu_monitor is set. */
+void monitor_cpu_online(unsigned int cpu);
+void monitor_cpu_offline(unsigned int cpu);
+
+/* The count period dropped back to count_timer_period: make the local
+ * timers read their counters now and tick at the new period. Called from
+ * the monitor timer. */
+void monitor_snap_back(void);
+
+/* LLC misses of all online CPUs since the previous call. Only called from
+ * the monitor timer, or from llc_event_wq while that timer is stopped. */
+u64 monitor_read_llc_misses(void);
+/* LLC load misses (l1D_event) of all online CPUs since the previous call.
+ * Only called from llc_event_wq. */
+u64 monitor_read_load_misses(void);
+
+/* share of @cpu in the totals of the last monitor_read_*() calls */
+u64 monitor_cpu_llc_misses(int cpu);
+u64 monitor_cpu_load_misses(int cpu);
+
+#endif // ANVIL_MONITOR_H
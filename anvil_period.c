@@ -0,0 +1,127 @@
+// Sampling period controller
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/perf_event.h>
+#include <linux/mutex.h>
+#include <linux/cpu.h>
+#include <linux/math64.h>
+#include <linux/time64.h>
+
+#include "anvil.h"
+#include "anvil_period.h"
+
+/*
+ * After every window, the handler time of each CPU is compared with the
+ * interrupt budget. A CPU over budget doubles its periods, a CPU below half
+ * of the budget halves them again while the window collected fewer than
+ * sample_target samples. Periods never drop below the configured
+ * ld_lat_sample_period / pre_str_sample_period, which stay the most
+ * aggressive rates the operator accepts.
+ */
+struct period_state {
+	unsigned int shift;
+	/* sample_costs at the end of the previous window */
+	u64 seen_ns;
+	unsigned long seen_samples;
+	/* handler ns per ms of the last window */
+	u64 use;
+	unsigned long samples;
+};
+
+DEFINE_PER_CPU(struct sample_cost, sample_costs);
+static DEFINE_PER_CPU(struct period_state, period_states);
+/* serializes retuning and runtime period changes */
+static DEFINE_MUTEX(period_mutex);
+
+static void apply_periods(int cpu, unsigned int shift)
+{
+	struct perf_event *event;
+
+	event = per_cpu(ld_lat_event, cpu);
+	if (!IS_ERR_OR_NULL(event))
+		perf_event_period(event, (u64)READ_ONCE(ld_lat_sample_period) << shift);
+
+	event = per_cpu(precise_str_event, cpu);
+	if (!IS_ERR_OR_NULL(event))
+		perf_event_period(event, (u64)READ_ONCE(pre_str_sample_period) << shift);
+}
+
+void sample_periods_tune(u64 window_ns)
+{
+	struct sample_cost *cost;
+	struct period_state *ps;
+	unsigned long samples = 0;
+	u64 budget, ns;
+	int cpu;
+
+	if (!window_ns)
+		return;
+
+	/* CPU hotplug releases the events of an offline CPU */
+	cpus_read_lock();
+	mutex_lock(&period_mutex);
+
+	/* what every CPU spent in the handlers during the window */
+	for_each_online_cpu(cpu) {
+		cost = per_cpu_ptr(&sample_costs, cpu);
+		ps = per_cpu_ptr(&period_states, cpu);
+
+		ns = READ_ONCE(cost->ns);
+		ps->use = div64_u64((ns - ps->seen_ns) * NSEC_PER_MSEC, window_ns);
+		ps->seen_ns = ns;
+
+		ps->samples = READ_ONCE(cost->samples) - ps->seen_samples;
+		ps->seen_samples += ps->samples;
+		samples += ps->samples;
+	}
+
+	budget = (u64)READ_ONCE(sample_budget_us) * NSEC_PER_USEC;
+	if (!budget)
+		goto out;
+
+	for_each_online_cpu(cpu) {
+		ps = per_cpu_ptr(&period_states, cpu);
+
+		if (ps->use > budget && ps->shift < SAMPLE_PERIOD_SHIFT_MAX) {
+			/* the budget protects the workload, it wins over the target */
+			apply_periods(cpu, ++ps->shift);
+		} else if (ps->use < budget / 2 && ps->shift && ps->samples &&
+			   samples < READ_ONCE(sample_target)) {
+			/* too few samples for a meaningful hammer threshold */
+			apply_periods(cpu, --ps->shift);
+		}
+	}
+
+out:
+	mutex_unlock(&period_mutex);
+	cpus_read_unlock();
+}
+
+void sample_periods_reset(void)
+{
+	int cpu;
+
+	cpus_read_lock();
+	mutex_lock(&period_mutex);
+	for_each_online_cpu(cpu) {
+		per_cpu_ptr(&period_states, cpu)->shift = 0;
+		apply_periods(cpu, 0);
+	}
+	mutex_unlock(&period_mutex);
+	cpus_read_unlock();
+}
+
+u64 sample_period_loads(int cpu)
+{
+	return (u64)READ_ONCE(ld_lat_sample_period) << READ_ONCE(per_cpu_ptr(&period_states, cpu)->shift);
+}
+
+u64 sample_period_stores(int cpu)
+{
+	return (u64)READ_ONCE(pre_str_sample_period) << READ_ONCE(per_cpu_ptr(&period_states, cpu)->shift);
+}
+
+u64 sample_budget_use(int cpu)
+{
+	return READ_ONCE(per_cpu_ptr(&period_states, cpu)->use);
+}
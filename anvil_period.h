@@ -0,0 +1,44 @@
+#ifndef ANVIL_PERIOD_H
+#define ANVIL_PERIOD_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/sched/clock.h>
+
+/* Upper bound of the period adjustment, periods grow to at most
+ * the configured period << SAMPLE_PERIOD_SHIFT_MAX */
+#define SAMPLE_PERIOD_SHIFT_MAX 8
+
+/* interrupt time allowed to the sampling handlers, in us per ms and CPU
+ * (0 disables the controller) */
+extern unsigned int sample_budget_us;
+/* samples a window should collect before periods are raised */
+extern unsigned int sample_target;
+
+/* sampling handler cost, written by the overflow handlers of the CPU */
+struct sample_cost {
+	u64 ns;
+	unsigned long irqs;
+	unsigned long samples;
+};
+DECLARE_PER_CPU(struct sample_cost, sample_costs);
+
+/* account one sampling interrupt that started at local_clock() @start */
+static inline void sample_cost_account(u64 start)
+{
+	this_cpu_add(sample_costs.ns, local_clock() - start);
+	this_cpu_inc(sample_costs.irqs);
+}
+
+/* retune the sampling periods of every online CPU after a window that
+ * sampled for @window_ns. May sleep. */
+void sample_periods_tune(u64 window_ns);
+/* drop all adjustments and apply the configured periods. May sleep. */
+void sample_periods_reset(void);
+
+u64 sample_period_loads(int cpu);
+u64 sample_period_stores(int cpu);
+/* handler time per ms of the last window on @cpu, in ns */
+u64 sample_budget_use(int cpu);
+
+#endif // ANVIL_PERIOD_H
@@ -0,0 +1,294 @@
+// Heavy-hitter address profile
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+
+#include "anvil.h"
+#include "anvil_profile.h"
+
+/*
+ * Space-Saving (Metwally et al.) over a fixed number of counters.
+ *
+ * Counters are kept in a stream-summary: a list of buckets in ascending
+ * count order, each holding the counters that share that count. A sample
+ * moves its counter to the next bucket, and a new key replaces a counter
+ * of the first (minimum) bucket, inheriting its count as error. Both are
+ * O(1), a key is found through an open-addressed hash table.
+ *
+ * With m counters and N samples, a key is overestimated by at most its
+ * err <= N/m, and every key seen more than N/m times is in the table.
+ */
+
+#define HH_NONE UINT_MAX
+
+struct hh_counter {
+	unsigned long key;
+	unsigned long err;
+	int cpu;
+	unsigned int bucket;
+	/* neighbours inside the bucket */
+	unsigned int prev;
+	unsigned int next;
+};
+
+struct hh_bucket {
+	unsigned long count;
+	unsigned int head;
+	/* neighbours in count order */
+	unsigned int prev;
+	unsigned int next;
+};
+
+static struct hh_counter *counters;
+static struct hh_bucket *buckets;
+/* key -> counter index, HH_NONE for an empty slot */
+static unsigned int *slots;
+
+static unsigned int counter_n;
+static unsigned int slot_bits;
+static unsigned int used;
+
+static unsigned int min_bucket;
+static unsigned int max_bucket;
+static unsigned int free_bucket;
+
+static unsigned int *slot_of(unsigned long key)
+{
+	unsigned int mask = (1U << slot_bits) - 1;
+	unsigned int i = hash_long(key, slot_bits);
+
+	while (slots[i] != HH_NONE && counters[slots[i]].key != key)
+		i = (i + 1) & mask;
+
+	return &slots[i];
+}
+
+/* Linear probing deletion, shift back the entries that probed past @key */
+static void slot_remove(unsigned long key)
+{
+	unsigned int mask = (1U << slot_bits) - 1;
+	unsigned int hole = slot_of(key) - slots;
+	unsigned int i = hole;
+	unsigned int home;
+
+	for (;;) {
+		i = (i + 1) & mask;
+		if (slots[i] == HH_NONE)
+			break;
+
+		home = hash_long(counters[slots[i]].key, slot_bits);
+		/* can the entry at i move into the hole? */
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			slots[hole] = slots[i];
+			hole = i;
+		}
+	}
+	slots[hole] = HH_NONE;
+}
+
+static unsigned int bucket_alloc(unsigned long count)
+{
+	unsigned int b = free_bucket;
+
+	free_bucket = buckets[b].next;
+	buckets[b].count = count;
+	buckets[b].head = HH_NONE;
+	buckets[b].prev = HH_NONE;
+	buckets[b].next = HH_NONE;
+
+	return b;
+}
+
+static void bucket_free(unsigned int b)
+{
+	if (buckets[b].prev != HH_NONE)
+		buckets[buckets[b].prev].next = buckets[b].next;
+	else
+		min_bucket = buckets[b].next;
+
+	if (buckets[b].next != HH_NONE)
+		buckets[buckets[b].next].prev = buckets[b].prev;
+	else
+		max_bucket = buckets[b].prev;
+
+	buckets[b].next = free_bucket;
+	free_bucket = b;
+}
+
+/* insert bucket @n right after @b, HH_NONE inserts it as the minimum */
+static void bucket_link_after(unsigned int n, unsigned int b)
+{
+	buckets[n].prev = b;
+	buckets[n].next = (b == HH_NONE) ? min_bucket : buckets[b].next;
+
+	if (buckets[n].next != HH_NONE)
+		buckets[buckets[n].next].prev = n;
+	else
+		max_bucket = n;
+
+	if (b != HH_NONE)
+		buckets[b].next = n;
+	else
+		min_bucket = n;
+}
+
+static void counter_unlink(unsigned int c)
+{
+	struct hh_counter *ctr = &counters[c];
+
+	if (ctr->prev != HH_NONE)
+		counters[ctr->prev].next = ctr->next;
+	else
+		buckets[ctr->bucket].head = ctr->next;
+
+	if (ctr->next != HH_NONE)
+		counters[ctr->next].prev = ctr->prev;
+}
+
+static void counter_link(unsigned int c, unsigned int b)
+{
+	struct hh_counter *ctr = &counters[c];
+
+	ctr->bucket = b;
+	ctr->prev = HH_NONE;
+	ctr->next = buckets[b].head;
+	if (ctr->next != HH_NONE)
+		counters[ctr->next].prev = c;
+	buckets[b].head = c;
+}
+
+/* Move counter @c to count + 1 */
+static void counter_increment(unsigned int c)
+{
+	unsigned int b = counters[c].bucket;
+	unsigned int nb = buckets[b].next;
+	unsigned long count = buckets[b].count + 1;
+	bool alone = buckets[b].head == c && counters[c].next == HH_NONE;
+
+	if (nb != HH_NONE && buckets[nb].count == count) {
+		counter_unlink(c);
+		counter_link(c, nb);
+		if (alone)
+			bucket_free(b);
+	} else if (alone) {
+		/* still below the next bucket, bump in place */
+		buckets[b].count = count;
+	} else {
+		nb = bucket_alloc(count);
+		bucket_link_after(nb, b);
+		counter_unlink(c);
+		counter_link(c, nb);
+	}
+}
+
+void profile_table_reset(void)
+{
+	unsigned int i;
+
+	memset(slots, 0xff, sizeof(*slots) << slot_bits);
+
+	/* every bucket back on the free list */
+	for (i = 0; i < counter_n; i++)
+		buckets[i].next = i + 1 < counter_n ? i + 1 : HH_NONE;
+	free_bucket = 0;
+	min_bucket = HH_NONE;
+	max_bucket = HH_NONE;
+
+	used = 0;
+}
+
+void profile_table_add(unsigned long key, int cpu)
+{
+	unsigned int *slot = slot_of(key);
+	unsigned int c, b;
+
+	if (*slot != HH_NONE) {
+		c = *slot;
+		counters[c].cpu = cpu;
+		counter_increment(c);
+		return;
+	}
+
+	if (used < counter_n) {
+		/* free counter, enters with count 1 */
+		c = used++;
+		counters[c].key = key;
+		counters[c].err = 0;
+		counters[c].cpu = cpu;
+		*slot = c;
+
+		b = min_bucket;
+		if (b == HH_NONE || buckets[b].count != 1) {
+			b = bucket_alloc(1);
+			bucket_link_after(b, HH_NONE);
+		}
+		counter_link(c, b);
+		return;
+	}
+
+	/* full, the new key takes over a minimum counter */
+	c = buckets[min_bucket].head;
+	slot_remove(counters[c].key);
+
+	counters[c].key = key;
+	counters[c].err = buckets[min_bucket].count;
+	counters[c].cpu = cpu;
+	*slot_of(key) = c;
+	counter_increment(c);
+}
+
+unsigned int profile_table_top(profile_t *out, unsigned int k)
+{
+	unsigned int n = 0;
+	unsigned int b, c;
+
+	/* buckets are in count order, walk down from the maximum */
+	for (b = max_bucket; b != HH_NONE && n < k; b = buckets[b].prev) {
+		for (c = buckets[b].head; c != HH_NONE && n < k; c = counters[c].next) {
+			out[n].phy_page = counters[c].key;
+			out[n].llc_total_miss = buckets[b].count;
+			out[n].err = counters[c].err;
+			out[n].activity = 0;
+			out[n].cpu = counters[c].cpu;
+			out[n].hammer = 0;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+unsigned int profile_table_size(void)
+{
+	return counter_n;
+}
+
+int profile_table_init(unsigned int size)
+{
+	counter_n = max_t(unsigned int, size, PROFILE_N);
+	/* keep the hash table at most half full */
+	slot_bits = ilog2(roundup_pow_of_two(counter_n)) + 1;
+
+	counters = kcalloc(counter_n, sizeof(*counters), GFP_KERNEL);
+	buckets = kcalloc(counter_n, sizeof(*buckets), GFP_KERNEL);
+	slots = kcalloc(1U << slot_bits, sizeof(*slots), GFP_KERNEL);
+	if (!counters || !buckets || !slots) {
+		profile_table_exit();
+		return -ENOMEM;
+	}
+
+	profile_table_reset();
+	return 0;
+}
+
+void profile_table_exit(void)
+{
+	kfree(counters);
+	kfree(buckets);
+	kfree(slots);
+	counters = NULL;
+	buckets = NULL;
+	slots = NULL;
+}
@@ -0,0 +1,19 @@
+#ifndef ANVIL_PROFILE_H
+#define ANVIL_PROFILE_H
+
+#include "anvil.h"
+
+/* allocate a heavy-hitter table tracking @size keys */
+int profile_table_init(unsigned int size);
+void profile_table_exit(void);
+
+/* forget all keys, called at the start of every window */
+void profile_table_reset(void);
+/* count one sample of @key, O(1) */
+void profile_table_add(unsigned long key, int cpu);
+/* copy the @k heaviest keys into @out, heaviest first */
+unsigned int profile_table_top(profile_t *out, unsigned int k);
+
+unsigned int profile_table_size(void);
+
+#endif // ANVIL_PROFILE_H
@@ -0,0 +1,414 @@
+// Victim row refresh engine
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/sort.h>
+#include <linux/ktime.h>
+#include <linux/cache.h>
+#include <linux/hash.h>
+#include <linux/time64.h>
+#include <linux/workqueue.h>
+#include <linux/nodemask.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <asm/special_insns.h>
+#include <asm/barrier.h>
+
+#include "anvil.h"
+#include "dram_mapping.h"
+#include "anvil_refresh.h"
+#include "anvil_trace.h"
+
+/* Upper bound of the cache lines refreshed per victim row */
+#define REFRESH_LINES_MAX 1024
+/* A page is spread over at most one row per cache line */
+#define AGGRESSOR_ROWS_MAX REFRESH_AGGRESSORS_MAX
+#define VICTIM_ROWS_MAX (AGGRESSOR_ROWS_MAX * 2 * REFRESH_RADIUS_MAX)
+
+/* Recently refreshed rows, set associative with LRU replacement */
+#define RECENT_SET_BITS 6
+#define RECENT_WAYS 4
+
+unsigned long refresh_count = 0;
+unsigned long refresh_line_total = 0;
+u64 refresh_time_ns = 0;
+unsigned long refresh_suppressed_count = 0;
+
+struct recent_row {
+	u64 key;
+	/* ktime_get_ns() of the last refresh, 0 for an empty way */
+	u64 stamp;
+	/* activity of the aggressors the last refresh was for */
+	u64 activity;
+};
+
+/*
+ * Victim rows are refreshed by a worker of their NUMA node, so the reads do
+ * not cross the interconnect. Aggressor rows are handed to the worker of
+ * their node, the caller waits for all of them. Every worker owns its
+ * buffers and the recent rows of its node, rows of different nodes never
+ * share a victim.
+ */
+struct refresh_node {
+	struct work_struct work;
+	int nid;
+
+	/* input and results of one dispatch */
+	struct dram_coords aggressors[AGGRESSOR_ROWS_MAX];
+	u64 activity[AGGRESSOR_ROWS_MAX];
+	unsigned int n;
+	/* aggressor page of the rows, all ones for aggressor rows */
+	unsigned long pfn;
+	unsigned int rows;
+	unsigned long lines;
+	unsigned long suppressed;
+
+	/* aggressors on the node and victim rows refreshed for them */
+	unsigned long detections;
+	unsigned long refreshes;
+
+	size_t row_lines[REFRESH_LINES_MAX];
+	struct dram_coords victim_rows[VICTIM_ROWS_MAX];
+	/* highest activity of the aggressors next to each victim row */
+	u64 victim_activity[VICTIM_ROWS_MAX];
+	struct recent_row recent_rows[1 << RECENT_SET_BITS][RECENT_WAYS];
+	/* dram_mapping_gen the recent rows were keyed with */
+	unsigned long mapping_gen;
+	/* refresh reads land here so they cannot be optimized away */
+	unsigned long sink;
+};
+
+static struct workqueue_struct *refresh_wq;
+static struct refresh_node *refresh_nodes[MAX_NUMNODES];
+
+/* Only used from the action work item, which never runs concurrently */
+static struct dram_coords aggressor_rows[AGGRESSOR_ROWS_MAX];
+static u64 aggressor_activity[AGGRESSOR_ROWS_MAX];
+
+static int line_compare(const void *a, const void *b)
+{
+	size_t la = *(const size_t *)a;
+	size_t lb = *(const size_t *)b;
+
+	if (la != lb)
+		return la < lb ? -1 : 1;
+	return 0;
+}
+
+static bool same_row(const struct dram_coords *a, const struct dram_coords *b)
+{
+	return dram_same_bank(a, b) && a->row == b->row;
+}
+
+/* add @row to @rows unless it is already there */
+static unsigned int add_row(struct dram_coords *rows, unsigned int n, unsigned int max,
+			    const struct dram_coords *row)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (same_row(&rows[i], row))
+			return n;
+	}
+	if (n < max)
+		rows[n++] = *row;
+	return n;
+}
+
+/* add victim @row of aggressors with @activity, a row next to several
+ * aggressors keeps the highest */
+static unsigned int add_victim(struct refresh_node *rn, unsigned int n,
+			       const struct dram_coords *row, u64 activity)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (same_row(&rn->victim_rows[i], row)) {
+			rn->victim_activity[i] = max(rn->victim_activity[i], activity);
+			return n;
+		}
+	}
+	if (n < VICTIM_ROWS_MAX) {
+		rn->victim_rows[n] = *row;
+		rn->victim_activity[n++] = activity;
+	}
+	return n;
+}
+
+/* Was @row refreshed less than the suppression interval before @now, for
+ * aggressors at least as active as @activity? A row whose aggressors got
+ * busier since is refreshed again. */
+static bool recently_refreshed(struct refresh_node *rn, const struct dram_coords *row,
+			       u64 now, u64 activity)
+{
+	struct recent_row *set;
+	u64 key = dram_row_key(row);
+	u64 interval;
+	int way;
+
+	interval = (u64)READ_ONCE(refresh_window_ms) * NSEC_PER_MSEC *
+		   READ_ONCE(refresh_suppress_percent) / 100;
+	if (!interval)
+		return false;
+
+	set = rn->recent_rows[hash_64(key, RECENT_SET_BITS)];
+	for (way = 0; way < RECENT_WAYS; way++) {
+		if (set[way].stamp && set[way].key == key)
+			return now - set[way].stamp < interval && activity <= set[way].activity;
+	}
+	return false;
+}
+
+static void mark_refreshed(struct refresh_node *rn, const struct dram_coords *row,
+			   u64 now, u64 activity)
+{
+	struct recent_row *set;
+	u64 key = dram_row_key(row);
+	int way, lru = 0;
+
+	set = rn->recent_rows[hash_64(key, RECENT_SET_BITS)];
+	for (way = 0; way < RECENT_WAYS; way++) {
+		if (set[way].key == key || !set[way].stamp) {
+			lru = way;
+			break;
+		}
+		if (set[way].stamp < set[lru].stamp)
+			lru = way;
+	}
+	set[lru].key = key;
+	set[lru].stamp = now;
+	set[lru].activity = activity;
+}
+
+/*
+ * Refresh one victim row by reading every cache line that maps to it back
+ * from DRAM. Lines are grouped by page: each page is mapped once, all of its
+ * lines are flushed with clflushopt, a single fence orders the flushes before
+ * the reads. Returns the number of lines read.
+ */
+static unsigned int refresh_row(struct refresh_node *rn, const struct dram_coords *row)
+{
+	size_t *row_lines = rn->row_lines;
+	size_t n, first, i, j;
+	unsigned long pfn;
+	unsigned int lines = 0;
+	struct page *pg;
+	char *virt;
+
+	n = dram_def->get_row_lines(row, row_lines, REFRESH_LINES_MAX);
+	sort(row_lines, n, sizeof(size_t), line_compare, NULL);
+
+	for (first = 0; first < n; first = i) {
+		pfn = row_lines[first] >> PAGE_SHIFT;
+		for (i = first; i < n && (row_lines[i] >> PAGE_SHIFT) == pfn; i++)
+			;
+
+		/* ensure page is not reserved or offline */
+		pg = pfn_to_online_page(pfn);
+		if (!pg || PageReserved(pg))
+			continue;
+
+		virt = kmap_local_page(pg);
+		for (j = first; j < i; j++)
+			clflushopt(virt + offset_in_page(row_lines[j]));
+		mb();
+		for (j = first; j < i; j++)
+			rn->sink += READ_ONCE(*(unsigned long *)(virt + offset_in_page(row_lines[j])));
+		kunmap_local(virt);
+
+		lines += i - first;
+	}
+
+	return lines;
+}
+
+/* Refresh the victims of the aggressor rows handed to a node */
+static void refresh_node_work(struct work_struct *work)
+{
+	struct refresh_node *rn = container_of(work, struct refresh_node, work);
+	struct dram_coords coords;
+	unsigned long mapping_gen = READ_ONCE(dram_mapping_gen);
+	unsigned int victims = 0;
+	unsigned int radius, i, d, lines;
+	u64 start;
+
+	start = ktime_get_ns();
+	radius = min_t(unsigned int, READ_ONCE(blast_radius), REFRESH_RADIUS_MAX);
+
+	/* a new DRAM mapping was uploaded, the recent rows are other rows now */
+	if (rn->mapping_gen != mapping_gen) {
+		memset(rn->recent_rows, 0, sizeof(rn->recent_rows));
+		rn->mapping_gen = mapping_gen;
+	}
+
+	rn->rows = 0;
+	rn->lines = 0;
+	rn->suppressed = 0;
+
+	/* neighbours in the same bank, every victim row once, also the row
+	 * shared by two aggressors */
+	for (i = 0; i < rn->n; i++) {
+		for (d = 1; d <= radius; d++) {
+			coords = rn->aggressors[i];
+			coords.row = rn->aggressors[i].row + d;
+			victims = add_victim(rn, victims, &coords, rn->activity[i]);
+			if (rn->aggressors[i].row >= d) {
+				coords.row = rn->aggressors[i].row - d;
+				victims = add_victim(rn, victims, &coords, rn->activity[i]);
+			}
+		}
+	}
+
+	for (i = 0; i < victims; i++) {
+		/* a row refreshed a moment ago for the same hammering is not at
+		 * risk yet */
+		if (recently_refreshed(rn, &rn->victim_rows[i], start, rn->victim_activity[i])) {
+			rn->suppressed++;
+			continue;
+		}
+
+		lines = refresh_row(rn, &rn->victim_rows[i]);
+		if (!lines)
+			continue;
+		mark_refreshed(rn, &rn->victim_rows[i], ktime_get_ns(), rn->victim_activity[i]);
+		/* lines are sorted, the first one names the victim page */
+		trace_anvil_refresh(rn->pfn, rn->row_lines[0] >> PAGE_SHIFT, &rn->victim_rows[i], lines);
+		rn->lines += lines;
+		rn->rows++;
+	}
+
+	rn->refreshes += rn->rows;
+}
+
+/* Worker of @nid, nodes without one are served by the first node */
+static struct refresh_node *refresh_node_of(size_t nid)
+{
+	int first = first_node(node_states[N_MEMORY]);
+
+	if (nid < MAX_NUMNODES && refresh_nodes[nid])
+		return refresh_nodes[nid];
+	return refresh_nodes[first];
+}
+
+/* Hand @aggressors and their @activity to the workers of their nodes and
+ * wait for them. With @per_row every row is a detection, otherwise the rows
+ * belong to the single aggressor page @pfn. */
+static unsigned int refresh_dispatch(const struct dram_coords *aggressors, const u64 *activity,
+				     unsigned int n, bool per_row, unsigned long pfn)
+{
+	struct refresh_node *rn;
+	unsigned int i, rows = 0;
+	int nid;
+	u64 start;
+
+	start = ktime_get_ns();
+	n = min_t(unsigned int, n, AGGRESSOR_ROWS_MAX);
+
+	for (i = 0; i < n; i++) {
+		rn = refresh_node_of(aggressors[i].node);
+		if (per_row || !rn->n)
+			rn->detections++;
+		rn->pfn = per_row ? ULONG_MAX : pfn;
+		rn->activity[rn->n] = activity ? activity[i] : 0;
+		rn->aggressors[rn->n++] = aggressors[i];
+	}
+
+	for_each_node(nid) {
+		rn = refresh_nodes[nid];
+		if (rn && rn->n)
+			queue_work_node(nid, refresh_wq, &rn->work);
+	}
+
+	for_each_node(nid) {
+		rn = refresh_nodes[nid];
+		if (!rn || !rn->n)
+			continue;
+		flush_work(&rn->work);
+		rows += rn->rows;
+		refresh_line_total += rn->lines;
+		refresh_suppressed_count += rn->suppressed;
+		rn->n = 0;
+	}
+
+	refresh_count += rows;
+	refresh_time_ns += ktime_get_ns() - start;
+
+	return rows;
+}
+
+unsigned int refresh_victims(unsigned long aggressor_pfn, u64 activity)
+{
+	struct dram_coords coords;
+	unsigned int aggressors = 0, i;
+	unsigned long offset;
+
+	BUILD_BUG_ON(PAGE_SIZE / L1_CACHE_BYTES > AGGRESSOR_ROWS_MAX);
+
+	/* rows touched by the aggressor, bank bits may depend on the line offset */
+	for (offset = 0; offset < PAGE_SIZE; offset += L1_CACHE_BYTES) {
+		if (!dram_def->decode_phys(PFN_PHYS(aggressor_pfn) + offset, &coords))
+			continue;
+		aggressors = add_row(aggressor_rows, aggressors, AGGRESSOR_ROWS_MAX, &coords);
+	}
+
+	for (i = 0; i < aggressors; i++)
+		aggressor_activity[i] = activity;
+
+	return refresh_dispatch(aggressor_rows, aggressor_activity, aggressors, false, aggressor_pfn);
+}
+
+unsigned int refresh_aggressor_rows(const struct dram_coords *aggressors, const u64 *activity,
+				    unsigned int n)
+{
+	return refresh_dispatch(aggressors, activity, n, true, ULONG_MAX);
+}
+
+bool refresh_node_stats(int nid, unsigned long *detections, unsigned long *refreshes)
+{
+	struct refresh_node *rn = refresh_nodes[nid];
+
+	if (!rn)
+		return false;
+
+	*detections = READ_ONCE(rn->detections);
+	*refreshes = READ_ONCE(rn->refreshes);
+	return true;
+}
+
+int refresh_init(bool highpri)
+{
+	struct refresh_node *rn;
+	int nid;
+
+	refresh_wq = alloc_workqueue("anvil_refresh", WQ_UNBOUND | (highpri ? WQ_HIGHPRI : 0), 0);
+	if (!refresh_wq)
+		return -ENOMEM;
+
+	/* buffers on the node they refresh */
+	for_each_node_state(nid, N_MEMORY) {
+		rn = kvzalloc_node(sizeof(*rn), GFP_KERNEL, nid);
+		if (!rn) {
+			refresh_exit();
+			return -ENOMEM;
+		}
+		rn->nid = nid;
+		INIT_WORK(&rn->work, refresh_node_work);
+		refresh_nodes[nid] = rn;
+	}
+
+	return 0;
+}
+
+void refresh_exit(void)
+{
+	int nid;
+
+	if (refresh_wq)
+		destroy_workqueue(refresh_wq);
+	refresh_wq = NULL;
+
+	for (nid = 0; nid < MAX_NUMNODES; nid++) {
+		kvfree(refresh_nodes[nid]);
+		refresh_nodes[nid] = NULL;
+	}
+}
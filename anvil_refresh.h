@@ -0,0 +1,46 @@
+#ifndef ANVIL_REFRESH_H
+#define ANVIL_REFRESH_H
+
+#include <linux/types.h>
+
+#include "dram_mapping.h"
+
+/* Upper bound of the blast_radius parameter */
+#define REFRESH_RADIUS_MAX 8
+/* Upper bound of the aggressor rows refreshed in one call, the rows of a page */
+#define REFRESH_AGGRESSORS_MAX 64
+
+/* rows on each side of an aggressor that are refreshed */
+extern unsigned int blast_radius;
+/* DRAM refresh window in milliseconds */
+extern unsigned int refresh_window_ms;
+/* rows refreshed within this share of the refresh window are skipped */
+extern unsigned int refresh_suppress_percent;
+
+/* refresh engine statistics, refresh_count counts victim rows in every mode */
+extern unsigned long refresh_count;
+extern unsigned long refresh_line_total;
+extern u64 refresh_time_ns;
+extern unsigned long refresh_suppressed_count;
+
+/* @highpri: refresh workers run ahead of ordinary kworkers */
+int refresh_init(bool highpri);
+void refresh_exit(void);
+
+/* Refresh every victim row within blast_radius of the rows touched by
+ * @aggressor_pfn, on a worker of the victims' NUMA node. @activity is the
+ * aggressor's activity, a victim refreshed recently for the same or less is
+ * skipped. Returns the number of victim rows refreshed. */
+unsigned int refresh_victims(unsigned long aggressor_pfn, u64 activity);
+
+/* Same for at most REFRESH_AGGRESSORS_MAX aggressor rows, a victim shared by
+ * several aggressors is refreshed once. @activity holds one value per row,
+ * NULL suppresses on time alone. */
+unsigned int refresh_aggressor_rows(const struct dram_coords *aggressors, const u64 *activity,
+				    unsigned int n);
+
+/* Aggressors detected on node @nid and victim rows refreshed for them,
+ * false if the node has no refresh worker */
+bool refresh_node_stats(int nid, unsigned long *detections, unsigned long *refreshes);
+
+#endif // ANVIL_REFRESH_H
@@ -0,0 +1,204 @@
+// Per-CPU sample rings
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/sched/mm.h>
+
+#include "anvil.h"
+#include "anvil_samples.h"
+
+/*
+ * One single-producer/single-consumer ring per CPU and buffer. The producer
+ * is the PEBS overflow handler of that CPU, the consumer is the action work
+ * item merging a closed window. head is only written by the producer and tail
+ * only by the consumer, so neither side needs a lock.
+ */
+struct sample_ring {
+	sample_t *buf;
+	unsigned int mask;
+	unsigned int head;
+	unsigned int tail;
+	/* set while the producer owns a reserved slot */
+	unsigned int busy;
+	/* written by the producer only */
+	unsigned long dropped;
+	/* written by the consumer only */
+	unsigned long discarded;
+	/* dropped at the previous drain */
+	unsigned long dropped_seen;
+};
+
+struct sample_rings {
+	struct sample_ring ring[SAMPLE_BUFFERS];
+};
+
+static DEFINE_PER_CPU(struct sample_rings, sample_rings);
+static unsigned int ring_capacity;
+
+static void release_sample(sample_t *sample)
+{
+	if (sample->mm)
+		mmput(sample->mm);
+}
+
+int sample_rings_init(unsigned int capacity)
+{
+	int cpu;
+	unsigned int buf;
+	struct sample_ring *ring;
+
+	ring_capacity = roundup_pow_of_two(capacity);
+
+	for_each_possible_cpu(cpu) {
+		for (buf = 0; buf < SAMPLE_BUFFERS; buf++) {
+			ring = &per_cpu_ptr(&sample_rings, cpu)->ring[buf];
+			ring->buf = kvmalloc_node(array_size(ring_capacity, sizeof(sample_t)),
+						  GFP_KERNEL | __GFP_ZERO, cpu_to_node(cpu));
+			if (!ring->buf) {
+				sample_rings_exit();
+				return -ENOMEM;
+			}
+			ring->mask = ring_capacity - 1;
+			ring->head = 0;
+			ring->tail = 0;
+			ring->busy = 0;
+			ring->dropped = 0;
+			ring->discarded = 0;
+			ring->dropped_seen = 0;
+		}
+	}
+
+	return 0;
+}
+
+void sample_rings_exit(void)
+{
+	int cpu;
+	unsigned int buf, tail;
+	struct sample_ring *ring;
+
+	for_each_possible_cpu(cpu) {
+		for (buf = 0; buf < SAMPLE_BUFFERS; buf++) {
+			ring = &per_cpu_ptr(&sample_rings, cpu)->ring[buf];
+			if (!ring->buf)
+				continue;
+
+			/* drop the mm references of samples nobody consumed */
+			for (tail = ring->tail; tail != ring->head; tail++)
+				release_sample(&ring->buf[tail & ring->mask]);
+
+			kvfree(ring->buf);
+			ring->buf = NULL;
+		}
+	}
+}
+
+/* Reserve the next slot of the local ring of @buf, NULL if the ring is full.
+ * Must be followed by sample_ring_commit() or sample_ring_cancel(). */
+sample_t *sample_ring_reserve(unsigned int buf)
+{
+	struct sample_ring *ring = &this_cpu_ptr(&sample_rings)->ring[buf];
+	unsigned int head;
+
+	/* a PEBS drain outside NMI can be interrupted by the overflow NMI,
+	 * the nested producer loses its sample instead of the slot */
+	if (ring->busy || !ring->buf) {
+		ring->dropped++;
+		return NULL;
+	}
+	ring->busy = 1;
+	barrier();
+
+	head = ring->head;
+	if (head - smp_load_acquire(&ring->tail) > ring->mask) {
+		ring->dropped++;
+		ring->busy = 0;
+		return NULL;
+	}
+
+	return &ring->buf[head & ring->mask];
+}
+
+void sample_ring_commit(unsigned int buf)
+{
+	struct sample_ring *ring = &this_cpu_ptr(&sample_rings)->ring[buf];
+
+	/* publish the slot contents before the new head */
+	smp_store_release(&ring->head, ring->head + 1);
+	barrier();
+	ring->busy = 0;
+}
+
+void sample_ring_cancel(unsigned int buf)
+{
+	struct sample_ring *ring = &this_cpu_ptr(&sample_rings)->ring[buf];
+
+	barrier();
+	ring->busy = 0;
+}
+
+size_t sample_rings_drain(unsigned int buf, u32 gen, sample_t *out, size_t max,
+			  unsigned long *dropped)
+{
+	int cpu;
+	size_t n = 0;
+	unsigned int head, tail;
+	unsigned long lost;
+	struct sample_ring *ring;
+	sample_t *sample;
+
+	*dropped = 0;
+
+	for_each_possible_cpu(cpu) {
+		ring = &per_cpu_ptr(&sample_rings, cpu)->ring[buf];
+		if (!ring->buf)
+			continue;
+
+		tail = ring->tail;
+		head = smp_load_acquire(&ring->head);
+		for (; tail != head; tail++) {
+			sample = &ring->buf[tail & ring->mask];
+			if (sample->gen != gen) {
+				/* landed after its window was drained */
+				release_sample(sample);
+			} else if (n < max) {
+				out[n++] = *sample;
+			} else {
+				/* merge buffer full, account it to the source CPU */
+				release_sample(sample);
+				ring->discarded++;
+				(*dropped)++;
+			}
+		}
+
+		/* full ring while the window was sampled into it */
+		lost = READ_ONCE(ring->dropped);
+		*dropped += lost - ring->dropped_seen;
+		ring->dropped_seen = lost;
+		/* hand the slots back to the producer */
+		smp_store_release(&ring->tail, tail);
+	}
+
+	return n;
+}
+
+unsigned int sample_ring_capacity(void)
+{
+	return ring_capacity;
+}
+
+unsigned long sample_ring_dropped(int cpu)
+{
+	struct sample_ring *ring;
+	unsigned long dropped = 0;
+	unsigned int buf;
+
+	for (buf = 0; buf < SAMPLE_BUFFERS; buf++) {
+		ring = &per_cpu_ptr(&sample_rings, cpu)->ring[buf];
+		dropped += READ_ONCE(ring->dropped) + READ_ONCE(ring->discarded);
+	}
+
+	return dropped;
+}
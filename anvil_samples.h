@@ -0,0 +1,31 @@
+#ifndef ANVIL_SAMPLES_H
+#define ANVIL_SAMPLES_H
+
+#include "anvil.h"
+
+/* Sample storage is double buffered: every CPU has one ring per buffer, a
+ * window fills buffer (gen % SAMPLE_BUFFERS) while the previous window is
+ * drained from the other one. */
+#define SAMPLE_BUFFERS 2
+
+/* allocate SAMPLE_BUFFERS rings of @capacity entries per possible CPU */
+int sample_rings_init(unsigned int capacity);
+/* release any samples still queued and free the rings */
+void sample_rings_exit(void);
+
+/* producer side, called from the overflow handlers on the local CPU */
+sample_t *sample_ring_reserve(unsigned int buf);
+void sample_ring_commit(unsigned int buf);
+void sample_ring_cancel(unsigned int buf);
+
+/* consumer side, merges the rings of @buf into @out (at most @max samples).
+ * Samples of another generation than @gen are stale and released. @dropped
+ * is set to the samples of the window that were lost. */
+size_t sample_rings_drain(unsigned int buf, u32 gen, sample_t *out, size_t max,
+			  unsigned long *dropped);
+
+unsigned int sample_ring_capacity(void);
+/* samples lost on @cpu because its ring or the merge buffer was full */
+unsigned long sample_ring_dropped(int cpu);
+
+#endif // ANVIL_SAMPLES_H
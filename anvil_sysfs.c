@@ -2,12 +2,35 @@
 #include <linux/kernel.h>
 #include <linux/kobject.h>
 #include <linux/sysfs.h>
+#include <linux/cpumask.h>
+#include <linux/nodemask.h>
+#include <linux/math64.h>
+#include <linux/time64.h>
 #include "anvil_sysfs.h"
+#include "anvil_samples.h"
+#include "anvil_refresh.h"
+#include "anvil_period.h"
+#include "anvil_targets.h"
+#include "anvil_activity.h"
+#include "anvil_migrate.h"
+#include "dram_mapping.h"
 
 /* Pulling variables from anvil */
-extern unsigned long refresh_count;
 extern unsigned long L1_count;
 extern unsigned long L2_count;
+extern unsigned long gup_fallback_count;
+extern unsigned long gup_walk_count;
+extern unsigned long profile_undersized_count;
+extern unsigned long window_rollover_count;
+extern unsigned long double_sided_count;
+extern u64 detect_time_ns;
+extern unsigned long para_sample_count;
+extern unsigned long para_refresh_count;
+extern u64 para_time_ns;
+extern u64 refresh_latency_ns;
+extern u64 refresh_latency_max_ns;
+extern unsigned long latency_violation_count;
+extern struct cpumask sampling_cpus;
 
 static struct kobject *anvil_kobj;
 
@@ -32,14 +55,344 @@ static ssize_t L2_count_show(struct kobject *kobj,
     return sprintf(buf, "%lu\n", L2_count);
 }
 
+static ssize_t gup_fallback_count_show(struct kobject *kobj,
+                                       struct kobj_attribute *attr,
+                                       char *buf)
+{
+    return sprintf(buf, "%lu\n", gup_fallback_count);
+}
+
+static ssize_t gup_walk_count_show(struct kobject *kobj,
+                                   struct kobj_attribute *attr,
+                                   char *buf)
+{
+    return sprintf(buf, "%lu\n", gup_walk_count);
+}
+
+static ssize_t profile_undersized_count_show(struct kobject *kobj,
+                                             struct kobj_attribute *attr,
+                                             char *buf)
+{
+    return sprintf(buf, "%lu\n", profile_undersized_count);
+}
+
+static ssize_t refresh_line_count_show(struct kobject *kobj,
+                                       struct kobj_attribute *attr,
+                                       char *buf)
+{
+    return sprintf(buf, "%lu\n", refresh_line_total);
+}
+
+/* average time spent per refreshed victim row */
+static ssize_t refresh_row_cost_ns_show(struct kobject *kobj,
+                                        struct kobj_attribute *attr,
+                                        char *buf)
+{
+    u64 rows = READ_ONCE(refresh_count);
+
+    return sprintf(buf, "%llu\n", rows ? div64_u64(READ_ONCE(refresh_time_ns), rows) : 0);
+}
+
+/* victim rows refreshed per second of refresh time */
+static ssize_t refresh_throughput_show(struct kobject *kobj,
+                                       struct kobj_attribute *attr,
+                                       char *buf)
+{
+    u64 ns = READ_ONCE(refresh_time_ns);
+
+    return sprintf(buf, "%llu\n", ns ? div64_u64((u64)READ_ONCE(refresh_count) * NSEC_PER_SEC, ns) : 0);
+}
+
+static ssize_t refresh_suppressed_count_show(struct kobject *kobj,
+                                             struct kobj_attribute *attr,
+                                             char *buf)
+{
+    return sprintf(buf, "%lu\n", refresh_suppressed_count);
+}
+
+static ssize_t window_rollover_count_show(struct kobject *kobj,
+                                          struct kobj_attribute *attr,
+                                          char *buf)
+{
+    return sprintf(buf, "%lu\n", window_rollover_count);
+}
+
+static ssize_t sample_drops_show(struct kobject *kobj,
+                                 struct kobj_attribute *attr,
+                                 char *buf)
+{
+    int cpu;
+    ssize_t len = 0;
+
+    /* one "cpu drops" line per online CPU */
+    for_each_online_cpu(cpu)
+        len += sysfs_emit_at(buf, len, "%d %lu\n", cpu, sample_ring_dropped(cpu));
+
+    return len;
+}
+
+static ssize_t late_sample_count_show(struct kobject *kobj,
+                                      struct kobj_attribute *attr,
+                                      char *buf)
+{
+    unsigned long late = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        late += READ_ONCE(per_cpu(late_samples, cpu));
+
+    return sprintf(buf, "%lu\n", late);
+}
+
+static ssize_t sample_ring_size_show(struct kobject *kobj,
+                                     struct kobj_attribute *attr,
+                                     char *buf)
+{
+    return sprintf(buf, "%u\n", sample_ring_capacity());
+}
+
+static ssize_t double_sided_count_show(struct kobject *kobj,
+                                       struct kobj_attribute *attr,
+                                       char *buf)
+{
+    return sprintf(buf, "%lu\n", double_sided_count);
+}
+
+static ssize_t detect_time_ns_show(struct kobject *kobj,
+                                   struct kobj_attribute *attr,
+                                   char *buf)
+{
+    return sprintf(buf, "%llu\n", detect_time_ns);
+}
+
+static ssize_t para_sample_count_show(struct kobject *kobj,
+                                      struct kobj_attribute *attr,
+                                      char *buf)
+{
+    return sprintf(buf, "%lu\n", para_sample_count);
+}
+
+static ssize_t para_refresh_count_show(struct kobject *kobj,
+                                       struct kobj_attribute *attr,
+                                       char *buf)
+{
+    return sprintf(buf, "%lu\n", para_refresh_count);
+}
+
+static ssize_t para_time_ns_show(struct kobject *kobj,
+                                 struct kobj_attribute *attr,
+                                 char *buf)
+{
+    return sprintf(buf, "%llu\n", para_time_ns);
+}
+
+static ssize_t refresh_latency_ns_show(struct kobject *kobj,
+                                       struct kobj_attribute *attr,
+                                       char *buf)
+{
+    return sprintf(buf, "%llu\n", refresh_latency_ns);
+}
+
+static ssize_t refresh_latency_max_ns_show(struct kobject *kobj,
+                                           struct kobj_attribute *attr,
+                                           char *buf)
+{
+    return sprintf(buf, "%llu\n", refresh_latency_max_ns);
+}
+
+static ssize_t latency_violation_count_show(struct kobject *kobj,
+                                            struct kobj_attribute *attr,
+                                            char *buf)
+{
+    return sprintf(buf, "%lu\n", latency_violation_count);
+}
+
+static ssize_t migrate_success_count_show(struct kobject *kobj,
+                                          struct kobj_attribute *attr,
+                                          char *buf)
+{
+    return sprintf(buf, "%lu\n", migrate_success_count);
+}
+
+static ssize_t migrate_fail_count_show(struct kobject *kobj,
+                                       struct kobj_attribute *attr,
+                                       char *buf)
+{
+    return sprintf(buf, "%lu\n", migrate_fail_count);
+}
+
+static ssize_t dram_mapping_sysfs_show(struct kobject *kobj,
+                                       struct kobj_attribute *attr,
+                                       char *buf)
+{
+    return dram_mapping_show(buf);
+}
+
+static ssize_t dram_mapping_sysfs_store(struct kobject *kobj,
+                                        struct kobj_attribute *attr,
+                                        const char *buf, size_t count)
+{
+    return dram_mapping_upload(buf, count);
+}
+
+static ssize_t dram_unmapped_count_show(struct kobject *kobj,
+                                        struct kobj_attribute *attr,
+                                        char *buf)
+{
+    return sprintf(buf, "%lu\n", dram_unmapped_count);
+}
+
+static ssize_t activity_tracked_show(struct kobject *kobj,
+                                     struct kobj_attribute *attr,
+                                     char *buf)
+{
+    return sprintf(buf, "%u\n", activity_tracked());
+}
+
+static ssize_t count_period_show(struct kobject *kobj,
+                                 struct kobj_attribute *attr,
+                                 char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(count_period_current));
+}
+
+static ssize_t sampling_cpus_show(struct kobject *kobj,
+                                  struct kobj_attribute *attr,
+                                  char *buf)
+{
+    return sysfs_emit(buf, "%*pbl\n", cpumask_pr_args(&sampling_cpus));
+}
+
+static ssize_t task_targets_show(struct kobject *kobj,
+                                 struct kobj_attribute *attr,
+                                 char *buf)
+{
+    pid_t tids[TASK_TARGETS_MAX];
+    unsigned int i, n;
+    ssize_t len = 0;
+
+    /* one thread id per line, empty while sampling on the CPUs */
+    n = task_targets_get(tids);
+    for (i = 0; i < n; i++)
+        len += sysfs_emit_at(buf, len, "%d\n", tids[i]);
+
+    return len;
+}
+
+static ssize_t sample_periods_show(struct kobject *kobj,
+                                   struct kobj_attribute *attr,
+                                   char *buf)
+{
+    int cpu;
+    ssize_t len = 0;
+
+    /* one "cpu load_period store_period" line per online CPU */
+    for_each_online_cpu(cpu)
+        len += sysfs_emit_at(buf, len, "%d %llu %llu\n", cpu,
+                             sample_period_loads(cpu), sample_period_stores(cpu));
+
+    return len;
+}
+
+static ssize_t node_refresh_stats_show(struct kobject *kobj,
+                                       struct kobj_attribute *attr,
+                                       char *buf)
+{
+    unsigned long detections, refreshes;
+    int nid;
+    ssize_t len = 0;
+
+    /* one "node detections refreshes" line per node with a refresh worker */
+    for_each_node_state(nid, N_MEMORY) {
+        if (refresh_node_stats(nid, &detections, &refreshes))
+            len += sysfs_emit_at(buf, len, "%d %lu %lu\n", nid, detections, refreshes);
+    }
+
+    return len;
+}
+
+static ssize_t sample_budget_use_show(struct kobject *kobj,
+                                      struct kobj_attribute *attr,
+                                      char *buf)
+{
+    int cpu;
+    ssize_t len = 0;
+
+    /* one "cpu ns_per_ms" line per online CPU */
+    for_each_online_cpu(cpu)
+        len += sysfs_emit_at(buf, len, "%d %llu\n", cpu, sample_budget_use(cpu));
+
+    return len;
+}
+
 static struct kobj_attribute refresh_count_attr = __ATTR(refresh_count, 0444, refresh_count_show, NULL);
 static struct kobj_attribute L1_count_attr = __ATTR(L1_count, 0444, L1_count_show, NULL);
 static struct kobj_attribute L2_count_attr = __ATTR(L2_count, 0444, L2_count_show, NULL);
+static struct kobj_attribute gup_fallback_count_attr = __ATTR(gup_fallback_count, 0444, gup_fallback_count_show, NULL);
+static struct kobj_attribute gup_walk_count_attr = __ATTR(gup_walk_count, 0444, gup_walk_count_show, NULL);
+static struct kobj_attribute profile_undersized_count_attr = __ATTR(profile_undersized_count, 0444, profile_undersized_count_show, NULL);
+static struct kobj_attribute refresh_line_count_attr = __ATTR(refresh_line_count, 0444, refresh_line_count_show, NULL);
+static struct kobj_attribute refresh_row_cost_ns_attr = __ATTR(refresh_row_cost_ns, 0444, refresh_row_cost_ns_show, NULL);
+static struct kobj_attribute refresh_throughput_attr = __ATTR(refresh_throughput, 0444, refresh_throughput_show, NULL);
+static struct kobj_attribute refresh_suppressed_count_attr = __ATTR(refresh_suppressed_count, 0444, refresh_suppressed_count_show, NULL);
+static struct kobj_attribute window_rollover_count_attr = __ATTR(window_rollover_count, 0444, window_rollover_count_show, NULL);
+static struct kobj_attribute sample_drops_attr = __ATTR(sample_drops, 0444, sample_drops_show, NULL);
+static struct kobj_attribute late_sample_count_attr = __ATTR(late_sample_count, 0444, late_sample_count_show, NULL);
+static struct kobj_attribute sample_ring_size_attr = __ATTR(sample_ring_size, 0444, sample_ring_size_show, NULL);
+static struct kobj_attribute double_sided_count_attr = __ATTR(double_sided_count, 0444, double_sided_count_show, NULL);
+static struct kobj_attribute detect_time_ns_attr = __ATTR(detect_time_ns, 0444, detect_time_ns_show, NULL);
+static struct kobj_attribute para_sample_count_attr = __ATTR(para_sample_count, 0444, para_sample_count_show, NULL);
+static struct kobj_attribute para_refresh_count_attr = __ATTR(para_refresh_count, 0444, para_refresh_count_show, NULL);
+static struct kobj_attribute para_time_ns_attr = __ATTR(para_time_ns, 0444, para_time_ns_show, NULL);
+static struct kobj_attribute refresh_latency_ns_attr = __ATTR(refresh_latency_ns, 0444, refresh_latency_ns_show, NULL);
+static struct kobj_attribute refresh_latency_max_ns_attr = __ATTR(refresh_latency_max_ns, 0444, refresh_latency_max_ns_show, NULL);
+static struct kobj_attribute latency_violation_count_attr = __ATTR(latency_violation_count, 0444, latency_violation_count_show, NULL);
+static struct kobj_attribute migrate_success_count_attr = __ATTR(migrate_success_count, 0444, migrate_success_count_show, NULL);
+static struct kobj_attribute migrate_fail_count_attr = __ATTR(migrate_fail_count, 0444, migrate_fail_count_show, NULL);
+static struct kobj_attribute dram_mapping_attr = __ATTR(dram_mapping, 0644, dram_mapping_sysfs_show, dram_mapping_sysfs_store);
+static struct kobj_attribute dram_unmapped_count_attr = __ATTR(dram_unmapped_count, 0444, dram_unmapped_count_show, NULL);
+static struct kobj_attribute activity_tracked_attr = __ATTR(activity_tracked, 0444, activity_tracked_show, NULL);
+static struct kobj_attribute count_period_attr = __ATTR(count_period, 0444, count_period_show, NULL);
+static struct kobj_attribute sampling_cpus_attr = __ATTR(sampling_cpus, 0444, sampling_cpus_show, NULL);
+static struct kobj_attribute task_targets_attr = __ATTR(task_targets, 0444, task_targets_show, NULL);
+static struct kobj_attribute sample_periods_attr = __ATTR(sample_periods, 0444, sample_periods_show, NULL);
+static struct kobj_attribute node_refresh_stats_attr = __ATTR(node_refresh_stats, 0444, node_refresh_stats_show, NULL);
+static struct kobj_attribute sample_budget_use_attr = __ATTR(sample_budget_use, 0444, sample_budget_use_show, NULL);
 
 static struct attribute *anvil_attrs[] = {
     &refresh_count_attr.attr,
     &L1_count_attr.attr,
     &L2_count_attr.attr,
+    &gup_fallback_count_attr.attr,
+    &gup_walk_count_attr.attr,
+    &profile_undersized_count_attr.attr,
+    &refresh_line_count_attr.attr,
+    &refresh_row_cost_ns_attr.attr,
+    &refresh_throughput_attr.attr,
+    &refresh_suppressed_count_attr.attr,
+    &node_refresh_stats_attr.attr,
+    &window_rollover_count_attr.attr,
+    &sample_drops_attr.attr,
+    &late_sample_count_attr.attr,
+    &sample_ring_size_attr.attr,
+    &double_sided_count_attr.attr,
+    &detect_time_ns_attr.attr,
+    &para_sample_count_attr.attr,
+    &para_refresh_count_attr.attr,
+    &para_time_ns_attr.attr,
+    &refresh_latency_ns_attr.attr,
+    &refresh_latency_max_ns_attr.attr,
+    &latency_violation_count_attr.attr,
+    &migrate_success_count_attr.attr,
+    &migrate_fail_count_attr.attr,
+    &dram_mapping_attr.attr,
+    &dram_unmapped_count_attr.attr,
+    &activity_tracked_attr.attr,
+    &count_period_attr.attr,
+    &sampling_cpus_attr.attr,
+    &task_targets_attr.attr,
+    &sample_periods_attr.attr,
+    &sample_budget_use_attr.attr,
     NULL,
 };
 
@@ -0,0 +1,316 @@
+// Process-targeted sampling
+#include <linux/kernel.h>
+#include <linux/sched.h>
+#include <linux/sched/task.h>
+#include <linux/pid.h>
+#include <linux/perf_event.h>
+#include <linux/mutex.h>
+#include <linux/sort.h>
+#include <linux/err.h>
+
+#include "anvil.h"
+#include "anvil_period.h"
+#include "anvil_targets.h"
+
+/*
+ * When a few threads cause nearly all samples of a window, later windows
+ * are sampled through per-task events on those threads only, so other
+ * tenants on the same CPUs stop taking PEBS interrupts. The LLC monitoring
+ * stays CPU wide: when another task raises the miss rate, the windows it
+ * triggers collect few samples and per-task sampling is given up after
+ * task_idle_windows of them. A busy suspect keeps its windows full, so
+ * every task_rescan_windows windows one is sampled on the CPUs again and
+ * the suspects are chosen anew from it.
+ */
+struct task_target {
+	struct task_struct *task;
+	pid_t tid;
+	struct perf_event *ld_lat_event;
+	struct perf_event *precise_str_event;
+};
+
+struct tid_count {
+	pid_t tid;
+	unsigned long count;
+};
+
+static struct task_target targets[TASK_TARGETS_MAX];
+static unsigned int target_n;
+/* windows in a row that collected fewer than sample_target samples */
+static unsigned int quiet_windows;
+/* per-task windows since the last one sampled on the CPUs */
+static unsigned int target_windows;
+/* sample the next windows on the CPUs to look for other suspects */
+static bool rescan;
+/* protects the targets, taken by action_wq and llc_event_wq */
+static DEFINE_MUTEX(targets_mutex);
+
+static void release_targets(void)
+{
+	struct task_target *t;
+	unsigned int i;
+
+	for (i = 0; i < target_n; i++) {
+		t = &targets[i];
+		if (t->ld_lat_event)
+			perf_event_release_kernel(t->ld_lat_event);
+		if (t->precise_str_event)
+			perf_event_release_kernel(t->precise_str_event);
+		put_task_struct(t->task);
+	}
+	memset(targets, 0, sizeof(targets));
+	target_n = 0;
+	quiet_windows = 0;
+	target_windows = 0;
+	rescan = false;
+}
+
+static struct perf_event *create_task_event(const struct perf_event_attr *attr, u64 period,
+					    struct task_struct *task,
+					    perf_overflow_handler_t callback)
+{
+	struct perf_event_attr task_attr = *attr;
+	struct perf_event *event;
+
+	/* flexible, the CPU-wide counters keep their pinned PMU slots */
+	task_attr.sample_period = period;
+	task_attr.pinned = 0;
+
+	event = perf_event_create_kernel_counter(&task_attr, -1, task, callback, NULL);
+	return IS_ERR(event) ? NULL : event;
+}
+
+static int add_target(pid_t tid)
+{
+	struct task_target *t = &targets[target_n];
+	struct pid *pid;
+
+	pid = find_get_pid(tid);
+	t->task = get_pid_task(pid, PIDTYPE_PID);
+	put_pid(pid);
+	if (!t->task)
+		return -ESRCH;
+
+	t->tid = tid;
+	t->ld_lat_event = create_task_event(&load_latency_event, READ_ONCE(ld_lat_sample_period),
+					    t->task, load_latency_callback);
+	t->precise_str_event = create_task_event(&precise_str_event_attr,
+						 READ_ONCE(pre_str_sample_period),
+						 t->task, precise_str_callback);
+	target_n++;
+
+	if (!t->ld_lat_event || !t->precise_str_event)
+		return -ENODEV;
+	return 0;
+}
+
+static int count_compare(const void *a, const void *b)
+{
+	const struct tid_count *ca = a;
+	const struct tid_count *cb = b;
+
+	if (ca->count != cb->count)
+		return ca->count > cb->count ? -1 : 1;
+	return 0;
+}
+
+static struct tid_count *find_tid(struct tid_count *cand, unsigned int k, pid_t tid)
+{
+	unsigned int i;
+
+	for (i = 0; i < k; i++) {
+		if (cand[i].tid == tid)
+			return &cand[i];
+	}
+	return NULL;
+}
+
+/* Threads with the most samples, heaviest first. Misra-Gries keeps every
+ * thread with more than n / (TASK_TARGETS_MAX + 1) samples, a second pass
+ * counts the candidates exactly. */
+static unsigned int count_candidates(const sample_t *samples, size_t n, struct tid_count *cand)
+{
+	struct tid_count *c;
+	unsigned int k = 0, i, j;
+	size_t s;
+
+	for (s = 0; s < n; s++) {
+		c = find_tid(cand, k, samples[s].tid);
+		if (c) {
+			c->count++;
+		} else if (k < TASK_TARGETS_MAX) {
+			cand[k].tid = samples[s].tid;
+			cand[k].count = 1;
+			k++;
+		} else {
+			for (i = 0, j = 0; i < k; i++) {
+				if (--cand[i].count)
+					cand[j++] = cand[i];
+			}
+			k = j;
+		}
+	}
+
+	for (i = 0; i < k; i++)
+		cand[i].count = 0;
+	for (s = 0; s < n; s++) {
+		c = find_tid(cand, k, samples[s].tid);
+		if (c)
+			c->count++;
+	}
+
+	sort(cand, k, sizeof(*cand), count_compare, NULL);
+	return k;
+}
+
+/* Threads that cover share percent of the @n samples, at most
+ * TASK_TARGETS_MAX of them in @cand. Returns their number, 0 if they do
+ * not exist. */
+static unsigned int select_targets(const sample_t *samples, size_t n, unsigned int share,
+				   struct tid_count *cand)
+{
+	unsigned long covered = 0;
+	unsigned int k, m = 0;
+
+	k = count_candidates(samples, n, cand);
+	while (m < k && covered * 100 < (unsigned long)share * n)
+		covered += cand[m++].count;
+
+	return covered * 100 < (unsigned long)share * n ? 0 : m;
+}
+
+/* Are the @m threads in @cand the current targets? */
+static bool same_targets(struct tid_count *cand, unsigned int m)
+{
+	unsigned int i;
+
+	if (m != target_n)
+		return false;
+	for (i = 0; i < m; i++) {
+		if (!find_tid(cand, m, targets[i].tid))
+			return false;
+	}
+	return true;
+}
+
+static bool targets_exited(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < target_n; i++) {
+		if (targets[i].task->flags & PF_EXITING)
+			return true;
+	}
+	return false;
+}
+
+void task_targets_update(const sample_t *samples, size_t n, bool per_task)
+{
+	struct tid_count cand[TASK_TARGETS_MAX];
+	unsigned int share = READ_ONCE(task_target_share);
+	unsigned int rescan_windows = READ_ONCE(task_rescan_windows);
+	unsigned int m;
+
+	mutex_lock(&targets_mutex);
+
+	if (target_n && (!share || targets_exited())) {
+		/* back to CPU-wide sampling once the suspects exit */
+		release_targets();
+		goto out;
+	}
+
+	if (target_n && per_task) {
+		/* or go quiet */
+		if (n < READ_ONCE(sample_target)) {
+			if (++quiet_windows >= READ_ONCE(task_idle_windows)) {
+				release_targets();
+				goto out;
+			}
+		} else {
+			quiet_windows = 0;
+		}
+		if (rescan_windows && ++target_windows >= rescan_windows)
+			rescan = true;
+		goto out;
+	}
+
+	/* a rescan window, sampled on the CPUs while there were suspects */
+	if (target_n) {
+		rescan = false;
+		target_windows = 0;
+	}
+
+	if (!share || !n || n < READ_ONCE(sample_target))
+		goto out;
+
+	/* do at most TASK_TARGETS_MAX threads cover share percent of the samples? */
+	m = select_targets(samples, n, share, cand);
+	if (target_n) {
+		if (m && same_targets(cand, m))
+			goto out;
+		/* another thread took a share of the misses */
+		release_targets();
+	}
+	if (!m)
+		goto out;
+
+	while (target_n < m) {
+		if (add_target(cand[target_n].tid)) {
+			/* a suspect that cannot be sampled would go unnoticed */
+			release_targets();
+			break;
+		}
+	}
+
+out:
+	mutex_unlock(&targets_mutex);
+}
+
+static void set_event(struct perf_event *event, bool enable)
+{
+	if (enable)
+		perf_event_enable(event);
+	else
+		perf_event_disable(event);
+}
+
+bool task_targets_start(unsigned int events)
+{
+	unsigned int i;
+	bool per_task;
+
+	mutex_lock(&targets_mutex);
+	/* a rescan window samples every task */
+	per_task = target_n && !rescan;
+	for (i = 0; i < target_n; i++) {
+		set_event(targets[i].ld_lat_event, per_task && (events & SAMPLE_LOADS));
+		set_event(targets[i].precise_str_event, per_task && (events & SAMPLE_STORES));
+	}
+	mutex_unlock(&targets_mutex);
+
+	return per_task;
+}
+
+void task_targets_stop(void)
+{
+	task_targets_start(0);
+}
+
+void task_targets_exit(void)
+{
+	mutex_lock(&targets_mutex);
+	release_targets();
+	mutex_unlock(&targets_mutex);
+}
+
+unsigned int task_targets_get(pid_t *tids)
+{
+	unsigned int i;
+
+	mutex_lock(&targets_mutex);
+	for (i = 0; i < target_n; i++)
+		tids[i] = targets[i].tid;
+	mutex_unlock(&targets_mutex);
+
+	return i;
+}
@@ -0,0 +1,32 @@
+#ifndef ANVIL_TARGETS_H
+#define ANVIL_TARGETS_H
+
+#include "anvil.h"
+
+/* Upper bound of the threads sampled through per-task events */
+#define TASK_TARGETS_MAX 4
+
+/* percentage of a window's samples the suspects must cover (0 disables) */
+extern unsigned int task_target_share;
+/* quiet windows after which per-task sampling is given up */
+extern unsigned int task_idle_windows;
+/* per-task windows after which one is sampled on the CPUs (0 never) */
+extern unsigned int task_rescan_windows;
+
+/* Look at the samples of an analyzed window, switch to per-task sampling
+ * when a few threads dominate it and back once they go quiet or exit.
+ * @per_task tells how the window was sampled, the suspects are chosen
+ * anew from a window sampled on the CPUs. Called from action_wq. */
+void task_targets_update(const sample_t *samples, size_t n, bool per_task);
+
+/* Enable @events on the suspects only. Returns false when there are none,
+ * or for a rescan, and the window has to be sampled on the CPUs. */
+bool task_targets_start(unsigned int events);
+void task_targets_stop(void);
+/* release the per-task events */
+void task_targets_exit(void);
+
+/* copy the suspect thread ids to @tids, returns their number */
+unsigned int task_targets_get(pid_t *tids);
+
+#endif // ANVIL_TARGETS_H
@@ -0,0 +1,181 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM anvil
+
+#if !defined(ANVIL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define ANVIL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "anvil.h"
+#include "dram_mapping.h"
+
+/* Profile entries reported per window, heaviest first */
+#define ANVIL_TRACE_TOP 4
+
+#define show_sampling_events(events)				\
+	__print_flags(events, "|",				\
+		{ SAMPLE_LOADS,		"load" },		\
+		{ SAMPLE_STORES,	"store" })
+
+/* LLC misses read by the sample timer */
+TRACE_EVENT(anvil_monitor_tick,
+
+	TP_PROTO(u64 miss_total, unsigned int threshold, unsigned int period, bool sampling),
+
+	TP_ARGS(miss_total, threshold, period, sampling),
+
+	TP_STRUCT__entry(
+		__field(u64,		miss_total)
+		__field(unsigned int,	threshold)
+		__field(unsigned int,	period)
+		__field(bool,		sampling)
+	),
+
+	TP_fast_assign(
+		__entry->miss_total	= miss_total;
+		__entry->threshold	= threshold;
+		__entry->period		= period;
+		__entry->sampling	= sampling;
+	),
+
+	TP_printk("miss_total=%llu threshold=%u period=%u sampling=%d",
+		  __entry->miss_total, __entry->threshold, __entry->period,
+		  __entry->sampling)
+);
+
+/* Events a window samples on @cpu, -1 for the per-task events */
+TRACE_EVENT(anvil_arm,
+
+	TP_PROTO(int cpu, u64 ld_miss, u64 llc_miss, unsigned int events),
+
+	TP_ARGS(cpu, ld_miss, llc_miss, events),
+
+	TP_STRUCT__entry(
+		__field(int,		cpu)
+		__field(u64,		ld_miss)
+		__field(u64,		llc_miss)
+		__field(unsigned int,	events)
+	),
+
+	TP_fast_assign(
+		__entry->cpu		= cpu;
+		__entry->ld_miss	= ld_miss;
+		__entry->llc_miss	= llc_miss;
+		__entry->events		= events;
+	),
+
+	TP_printk("cpu=%d ld_miss=%llu llc_miss=%llu events=%s",
+		  __entry->cpu, __entry->ld_miss, __entry->llc_miss,
+		  show_sampling_events(__entry->events))
+);
+
+/* A closed window was drained, @dropped counts its lost samples */
+TRACE_EVENT(anvil_window_close,
+
+	TP_PROTO(unsigned long gen, u64 miss_total, size_t samples, unsigned long dropped),
+
+	TP_ARGS(gen, miss_total, samples, dropped),
+
+	TP_STRUCT__entry(
+		__field(unsigned long,	gen)
+		__field(u64,		miss_total)
+		__field(size_t,		samples)
+		__field(unsigned long,	dropped)
+	),
+
+	TP_fast_assign(
+		__entry->gen		= gen;
+		__entry->miss_total	= miss_total;
+		__entry->samples	= samples;
+		__entry->dropped	= dropped;
+	),
+
+	TP_printk("gen=%lu miss_total=%llu samples=%zu dropped=%lu",
+		  __entry->gen, __entry->miss_total, __entry->samples,
+		  __entry->dropped)
+);
+
+/* Profile of a window above the miss threshold. Keys are pages, or row keys
+ * with row_aggregation. */
+TRACE_EVENT(anvil_profile,
+
+	TP_PROTO(const profile_t *profile, unsigned int records,
+		 unsigned int hammer_threshold, u64 aggressor_misses),
+
+	TP_ARGS(profile, records, hammer_threshold, aggressor_misses),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	records)
+		__field(unsigned int,	hammer_threshold)
+		__field(u64,		aggressor_misses)
+		__array(unsigned long,	keys,		ANVIL_TRACE_TOP)
+		__array(unsigned long,	samples,	ANVIL_TRACE_TOP)
+		__array(unsigned long,	activity,	ANVIL_TRACE_TOP)
+	),
+
+	TP_fast_assign(
+		unsigned int i;
+
+		__entry->records		= records;
+		__entry->hammer_threshold	= hammer_threshold;
+		__entry->aggressor_misses	= aggressor_misses;
+		for (i = 0; i < ANVIL_TRACE_TOP; i++) {
+			__entry->keys[i]	= i < records ? profile[i].phy_page : 0;
+			__entry->samples[i]	= i < records ? profile[i].llc_total_miss : 0;
+			__entry->activity[i]	= i < records ? profile[i].activity : 0;
+		}
+	),
+
+	TP_printk("records=%u hammer_threshold=%u aggressor_misses=%llu keys=%s samples=%s activity=%s",
+		  __entry->records, __entry->hammer_threshold, __entry->aggressor_misses,
+		  __print_array(__entry->keys, ANVIL_TRACE_TOP, sizeof(unsigned long)),
+		  __print_array(__entry->samples, ANVIL_TRACE_TOP, sizeof(unsigned long)),
+		  __print_array(__entry->activity, ANVIL_TRACE_TOP, sizeof(unsigned long)))
+);
+
+/* A victim row was read back. @aggressor is the aggressor page, all ones
+ * for aggressor rows of row_aggregation, @victim the first page of the row. */
+TRACE_EVENT(anvil_refresh,
+
+	TP_PROTO(unsigned long aggressor, unsigned long victim,
+		 const struct dram_coords *row, unsigned int lines),
+
+	TP_ARGS(aggressor, victim, row, lines),
+
+	TP_STRUCT__entry(
+		__field(unsigned long,	aggressor)
+		__field(unsigned long,	victim)
+		__field(unsigned int,	node)
+		__field(unsigned int,	channel)
+		__field(unsigned int,	rank)
+		__field(unsigned int,	bank_group)
+		__field(unsigned int,	bank)
+		__field(u64,		row)
+		__field(unsigned int,	lines)
+	),
+
+	TP_fast_assign(
+		__entry->aggressor	= aggressor;
+		__entry->victim		= victim;
+		__entry->node		= row->node;
+		__entry->channel	= row->channel;
+		__entry->rank		= row->rank;
+		__entry->bank_group	= row->bank_group;
+		__entry->bank		= row->bank;
+		__entry->row		= row->row;
+		__entry->lines		= lines;
+	),
+
+	TP_printk("aggressor=0x%lx victim=0x%lx node=%u channel=%u rank=%u bank_group=%u bank=%u row=%llu lines=%u",
+		  __entry->aggressor, __entry->victim, __entry->node, __entry->channel,
+		  __entry->rank, __entry->bank_group, __entry->bank, __entry->row,
+		  __entry->lines)
+);
+
+#endif // ANVIL_TRACE_H
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE anvil_trace
+#include <trace/define_trace.h>
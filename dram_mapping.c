@@ -3,16 +3,88 @@
 #include <asm/processor.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/random.h>
+#include <linux/cache.h>
+#include <linux/bitops.h>
+#include <linux/nodemask.h>
+#include <linux/mmzone.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/err.h>
 #include <asm/page_types.h>
 
 struct dram_mapping_ops* dram_def = NULL;
 EXPORT_SYMBOL(dram_def);
 
+unsigned long dram_unmapped_count = 0;
+unsigned long dram_mapping_gen = 0;
+EXPORT_SYMBOL(dram_mapping_gen);
+EXPORT_SYMBOL(dram_unmapped_count);
+
+// Config of the detected CPU, used for every node without its own
 static const struct dram_config* active_config = NULL;
 
 #define PFN_TO_PHYS(pfn) ((size_t)(pfn) << PAGE_SHIFT)
 #define PHYS_TO_PFN(phys) ((size_t)(phys) >> PAGE_SHIFT)
 
+// One lookup table per address byte
+#define XLAT_SLICES sizeof(size_t)
+// Random addresses compared against apply_matrix at registration
+#define XLAT_SELFTEST_ROUNDS 1024
+// Random pfns translated back and forth at registration
+#define XLAT_ROUNDTRIP_ROUNDS 1024
+// Upper bound of the holes of an uploaded config
+#define DRAM_UPLOAD_HOLES_MAX 8
+
+// Byte-sliced form of a mapping matrix: lut[s][v] is the matrix applied to
+// v << (8 * s). The matrix is linear over GF(2), so applying it to an address
+// is the XOR of one entry per address byte.
+struct dram_xlat {
+    unsigned int slices;
+    size_t lut[XLAT_SLICES][256];
+};
+
+// DRAM address space of one NUMA node: its PFN range, the physical address
+// of its DRAM address 0 and the lookup tables of its config
+struct dram_node {
+    int nid;
+    const struct dram_config* config;
+    size_t start_pfn;
+    size_t end_pfn;
+    size_t offset;
+
+    struct dram_xlat* to_dram; // phys -> dram
+    struct dram_xlat* to_phys; // dram -> phys
+    // config uploaded at runtime, freed with the node
+    struct dram_upload* upload;
+
+    // The lines of a row are the line address of its column 0 XORed with the
+    // span of the column bits, restricted to the bits above the line offset
+    size_t row_line_basis[BITS_PER_LONG];
+    unsigned int row_line_rank;
+};
+
+// A config uploaded through sysfs and the storage it points into
+struct dram_upload {
+    struct dram_config config;
+    char name[32];
+    size_t dram_matrix[BITS_PER_LONG];
+    size_t addr_matrix[BITS_PER_LONG];
+    struct dram_hole holes[DRAM_UPLOAD_HOLES_MAX];
+};
+
+// Nodes are replaced under dram_mutex and read under RCU, a new mapping
+// takes effect without stopping the translations in flight
+static struct dram_node __rcu* dram_nodes[MAX_NUMNODES];
+static DEFINE_MUTEX(dram_mutex);
+// Node ids with a config, in ascending order. Only grows while the mapping
+// is registered, uploads replace existing nodes.
+static int dram_node_ids[MAX_NUMNODES];
+static unsigned int dram_node_count = 0;
+
 // 
 // GENERIC XOR-BASED DRAM MAPPING
 //
@@ -27,58 +99,793 @@ static size_t apply_matrix(const size_t* matrix, unsigned int size, size_t addr)
     return result;
 }
 
-static size_t generic_get_linearized_addr(size_t pfn) {
-    return apply_matrix(active_config->dram_matrix, active_config->matrix_size, PFN_TO_PHYS(pfn));
+static size_t xlat_apply(const struct dram_xlat* xlat, size_t addr) {
+    size_t result = 0;
+    unsigned int s;
+    for (s = 0; s < xlat->slices; ++s, addr >>= 8) {
+        result ^= xlat->lut[s][addr & 0xff];
+    }
+    return result;
+}
+
+static struct dram_xlat* xlat_build(const size_t* matrix, unsigned int size) {
+    struct dram_xlat* xlat;
+    unsigned int s, v;
+
+    xlat = kzalloc(sizeof(*xlat), GFP_KERNEL);
+    if (!xlat) {
+        return NULL;
+    }
+
+    xlat->slices = min_t(unsigned int, DIV_ROUND_UP(size, 8), XLAT_SLICES);
+    for (s = 0; s < xlat->slices; ++s) {
+        for (v = 0; v < 256; ++v) {
+            xlat->lut[s][v] = apply_matrix(matrix, size, (size_t)v << (8 * s));
+        }
+    }
+    return xlat;
+}
+
+// Compare the tables against the bit-serial matrix code, on every single
+// address bit and on random addresses
+static int xlat_selftest(const struct dram_xlat* xlat, const size_t* matrix, unsigned int size) {
+    size_t addr;
+    int i;
+
+    for (i = 0; i < XLAT_SELFTEST_ROUNDS + BITS_PER_LONG; ++i) {
+        addr = i < BITS_PER_LONG ? BIT(i) : get_random_long();
+        if (xlat_apply(xlat, addr) != apply_matrix(matrix, size, addr)) {
+            printk(KERN_ERR "anvil: DRAM lookup table mismatch for 0x%zx\n", addr);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static void dram_node_free(struct dram_node* node) {
+    if (!node) {
+        return;
+    }
+    kfree(node->to_dram);
+    kfree(node->to_phys);
+    kfree(node->upload);
+    kfree(node);
+}
+
+static void row_lines_init(struct dram_node* node) {
+    const struct dram_config* config = node->config;
+    size_t echelon[BITS_PER_LONG] = { 0 };
+    size_t v;
+    int i, b;
+
+    for (i = 0; i + config->column_shift < BITS_PER_LONG; ++i) {
+        if (!(config->column_mask & BIT(i))) {
+            continue;
+        }
+        v = xlat_apply(node->to_phys, BIT(i) << config->column_shift) & ~(size_t)(L1_CACHE_BYTES - 1);
+
+        // Gaussian elimination, keep one vector per leading bit
+        for (b = BITS_PER_LONG - 1; b >= 0 && v; --b) {
+            if (!(v & BIT(b))) {
+                continue;
+            }
+            if (!echelon[b]) {
+                echelon[b] = v;
+                break;
+            }
+            v ^= echelon[b];
+        }
+    }
+
+    node->row_line_rank = 0;
+    for (b = 0; b < BITS_PER_LONG; ++b) {
+        if (echelon[b]) {
+            node->row_line_basis[node->row_line_rank++] = echelon[b];
+        }
+    }
+}
+
+// Build the lookup tables of both directions for a config
+static int dram_xlat_init(struct dram_node* node) {
+    const struct dram_config* config = node->config;
+    int ret;
+
+    node->to_dram = xlat_build(config->dram_matrix, config->matrix_size);
+    node->to_phys = xlat_build(config->addr_matrix, config->matrix_size);
+    if (!node->to_dram || !node->to_phys) {
+        return -ENOMEM;
+    }
+
+    ret = xlat_selftest(node->to_dram, config->dram_matrix, config->matrix_size);
+    if (!ret) {
+        ret = xlat_selftest(node->to_phys, config->addr_matrix, config->matrix_size);
+    }
+    if (ret) {
+        return ret;
+    }
+
+    row_lines_init(node);
+    return 0;
+}
+
+// Node whose PFN range holds pfn, NULL outside every node. Caller holds
+// rcu_read_lock().
+static const struct dram_node* dram_node_of(size_t pfn) {
+    const struct dram_node* node;
+    unsigned int i;
+
+    for (i = 0; i < dram_node_count; ++i) {
+        node = rcu_dereference(dram_nodes[dram_node_ids[i]]);
+        if (pfn >= node->start_pfn && pfn < node->end_pfn) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+// Caller holds rcu_read_lock()
+static const struct dram_node* dram_node_by_id(size_t nid) {
+    return nid < MAX_NUMNODES ? rcu_dereference(dram_nodes[nid]) : NULL;
+}
+
+static const struct dram_node* dram_node_by_id_locked(int nid) {
+    if (nid < 0 || nid >= MAX_NUMNODES) {
+        return NULL;
+    }
+    return rcu_dereference_protected(dram_nodes[nid], lockdep_is_held(&dram_mutex));
+}
+
+// Physical address with the holes below it removed, SIZE_MAX inside a hole
+static size_t phys_without_holes(const struct dram_config* config, size_t phys) {
+    size_t addr = phys;
+    size_t i;
+
+    for (i = 0; i < config->nr_holes && phys >= config->holes[i].start; ++i) {
+        if (phys - config->holes[i].start < config->holes[i].size) {
+            return SIZE_MAX;
+        }
+        addr -= config->holes[i].size;
+    }
+    return addr;
+}
+
+static size_t phys_with_holes(const struct dram_config* config, size_t addr) {
+    size_t i;
+
+    for (i = 0; i < config->nr_holes && addr >= config->holes[i].start; ++i) {
+        addr += config->holes[i].size;
+    }
+    return addr;
+}
+
+// Physical address -> address inside the DRAM of a node. False for holes and
+// for addresses beyond the matrix, which would alias other rows.
+static bool phys_to_local(const struct dram_node* node, size_t phys, size_t* local) {
+    const struct dram_config* config = node->config;
+    size_t addr = phys_without_holes(config, phys);
+
+    if (addr == SIZE_MAX || addr < node->offset) {
+        return false;
+    }
+    addr -= node->offset;
+    if (config->matrix_size < BITS_PER_LONG && (addr >> config->matrix_size)) {
+        return false;
+    }
+    *local = addr;
+    return true;
+}
+
+static size_t local_to_phys(const struct dram_node* node, size_t local) {
+    return phys_with_holes(node->config, local + node->offset);
+}
+
+#define DRAM_FIELD(addr, config, f) (((addr) >> (config)->f##_shift) & (config)->f##_mask)
+
+// DRAM address of coordinates, each field must fit its mask
+static size_t dram_compose(const struct dram_config* config, const struct dram_coords* c) {
+    return ((c->channel & config->channel_mask) << config->channel_shift) |
+           ((c->rank & config->rank_mask) << config->rank_shift) |
+           ((c->bank_group & config->bank_group_mask) << config->bank_group_shift) |
+           ((c->bank & config->bank_mask) << config->bank_shift) |
+           ((c->row & config->row_mask) << config->row_shift) |
+           ((c->column & config->column_mask) << config->column_shift);
+}
+
+static bool dram_coords_valid(const struct dram_config* config, const struct dram_coords* c) {
+    return !(c->channel & ~config->channel_mask) && !(c->rank & ~config->rank_mask) &&
+           !(c->bank_group & ~config->bank_group_mask) && !(c->bank & ~config->bank_mask) &&
+           !(c->row & ~config->row_mask) && !(c->column & ~config->column_mask);
+}
+
+static bool generic_decode_phys(size_t phys, struct dram_coords *coords) {
+    const struct dram_node* node;
+    const struct dram_config* config;
+    size_t linearized;
+
+    rcu_read_lock();
+    node = dram_node_of(PHYS_TO_PFN(phys));
+    if (!node || !phys_to_local(node, phys, &linearized)) {
+        rcu_read_unlock();
+        dram_unmapped_count++;
+        return false;
+    }
+    config = node->config;
+
+    linearized = xlat_apply(node->to_dram, linearized);
+    coords->node = node->nid;
+    coords->channel = DRAM_FIELD(linearized, config, channel);
+    coords->rank = DRAM_FIELD(linearized, config, rank);
+    coords->bank_group = DRAM_FIELD(linearized, config, bank_group);
+    coords->bank = DRAM_FIELD(linearized, config, bank);
+    coords->row = DRAM_FIELD(linearized, config, row);
+    coords->column = DRAM_FIELD(linearized, config, column);
+    rcu_read_unlock();
+    return true;
+}
+
+static bool generic_decode(size_t pfn, struct dram_coords *coords) {
+    return generic_decode_phys(PFN_TO_PHYS(pfn), coords);
 }
 
 static size_t generic_get_bank(size_t pfn) {
-    size_t linearized = generic_get_linearized_addr(pfn);
-    return (linearized >> active_config->bank_shift) & active_config->bank_mask;
+    struct dram_coords coords;
+    return generic_decode(pfn, &coords) ? coords.bank : 0;
 }
 
 static size_t generic_get_row(size_t pfn) {
-    size_t linearized = generic_get_linearized_addr(pfn);
-    return (linearized >> active_config->row_shift) & active_config->row_mask;
+    struct dram_coords coords;
+    return generic_decode(pfn, &coords) ? coords.row : 0;
 }
 
 static size_t generic_get_column(size_t pfn) {
-    size_t linearized = generic_get_linearized_addr(pfn);
-    return (linearized >> active_config->column_shift) & active_config->column_mask;
+    struct dram_coords coords;
+    return generic_decode(pfn, &coords) ? coords.column : 0;
 }
 
 static size_t generic_get_rank(size_t pfn) {
-    return 0; 
+    struct dram_coords coords;
+    return generic_decode(pfn, &coords) ? coords.rank : 0;
 }
 
-static size_t get_pfn_from_dram_coords(size_t bank, size_t row, size_t col) {
-    size_t linearized_addr = 
-        ((bank & active_config->bank_mask) << active_config->bank_shift) |
-        ((row & active_config->row_mask) << active_config->row_shift) |
-        ((col & active_config->column_mask) << active_config->column_shift);
-    size_t phys_addr = apply_matrix(active_config->addr_matrix, active_config->matrix_size, linearized_addr);
-    return PHYS_TO_PFN(phys_addr);
-}
+static size_t generic_get_row_lines(const struct dram_coords *coords, size_t *lines, size_t max) {
+    const struct dram_node* node;
+    struct dram_coords row;
+    size_t line, n, k;
 
-static size_t generic_get_row_plus(size_t pfn, int inc) {
-    return get_pfn_from_dram_coords(generic_get_bank(pfn), generic_get_row(pfn) + inc, generic_get_column(pfn));
-}
+    rcu_read_lock();
+    node = dram_node_by_id(coords->node);
+    if (!node || !dram_coords_valid(node->config, coords)) {
+        rcu_read_unlock();
+        return 0;
+    }
 
-static size_t generic_get_row_minus(size_t pfn, int dec) {
-    return get_pfn_from_dram_coords(generic_get_bank(pfn), generic_get_row(pfn) - dec, generic_get_column(pfn));
-}
+    row = *coords;
+    row.column = 0;
+    line = xlat_apply(node->to_phys, dram_compose(node->config, &row));
+    line &= ~(size_t)(L1_CACHE_BYTES - 1);
+
+    n = (size_t)1 << node->row_line_rank;
+    if (n > max) {
+        n = max;
+    }
 
+    // Gray code order, every line differs from the previous one by one basis
+    // vector. The basis is linear in the node's DRAM, holes are skipped after.
+    for (k = 0; k < n; ++k) {
+        if (k) {
+            line ^= node->row_line_basis[__ffs(k)];
+        }
+        lines[k] = local_to_phys(node, line);
+    }
+    rcu_read_unlock();
+    return n;
+}
 
 static struct dram_mapping_ops generic_dram_ops = {
     .get_bank = generic_get_bank,
     .get_row = generic_get_row,
     .get_column = generic_get_column,
     .get_rank = generic_get_rank,
-    .get_row_plus = generic_get_row_plus,
-    .get_row_minus = generic_get_row_minus,
+    .decode = generic_decode,
+    .decode_phys = generic_decode_phys,
+    .get_row_lines = generic_get_row_lines,
+};
+
+// Caller holds dram_mutex or is the only user of the mapping
+static void dram_nodes_free(void) {
+    struct dram_node* node;
+    unsigned int i;
+
+    for (i = 0; i < dram_node_count; ++i) {
+        node = rcu_dereference_protected(dram_nodes[dram_node_ids[i]], true);
+        RCU_INIT_POINTER(dram_nodes[dram_node_ids[i]], NULL);
+        dram_node_free(node);
+    }
+    dram_node_count = 0;
+}
+
+// Fields of a layout, as "name=mask:shift" in an upload, and their width in
+// a row key (0 for none)
+static const struct {
+    const char* name;
+    size_t mask;
+    size_t shift;
+    unsigned int key_bits;
+} dram_fields[] = {
+    { "channel", offsetof(struct dram_config, channel_mask), offsetof(struct dram_config, channel_shift),
+      DRAM_ROW_KEY_NODE_SHIFT - DRAM_ROW_KEY_CHANNEL_SHIFT },
+    { "rank", offsetof(struct dram_config, rank_mask), offsetof(struct dram_config, rank_shift),
+      DRAM_ROW_KEY_CHANNEL_SHIFT - DRAM_ROW_KEY_RANK_SHIFT },
+    { "bank_group", offsetof(struct dram_config, bank_group_mask), offsetof(struct dram_config, bank_group_shift),
+      DRAM_ROW_KEY_RANK_SHIFT - DRAM_ROW_KEY_BANK_GROUP_SHIFT },
+    { "bank", offsetof(struct dram_config, bank_mask), offsetof(struct dram_config, bank_shift),
+      DRAM_ROW_KEY_BANK_GROUP_SHIFT - DRAM_ROW_KEY_BANK_SHIFT },
+    { "row", offsetof(struct dram_config, row_mask), offsetof(struct dram_config, row_shift),
+      DRAM_ROW_KEY_BANK_SHIFT },
+    { "column", offsetof(struct dram_config, column_mask), offsetof(struct dram_config, column_shift), 0 },
 };
 
+#define DRAM_CONFIG_FIELD(config, off) (*(size_t*)((char*)(config) + (off)))
+
+// Every field must fit its bits of a row key, or rows of different banks
+// would share a key
+static int dram_key_check(const struct dram_config* config) {
+    size_t mask;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(dram_fields); ++i) {
+        mask = DRAM_CONFIG_FIELD(config, dram_fields[i].mask);
+        if (dram_fields[i].key_bits && (mask >> dram_fields[i].key_bits)) {
+            printk(KERN_ERR "anvil: %s: %s mask 0x%zx wider than %u bits\n", config->name,
+                   dram_fields[i].name, mask, dram_fields[i].key_bits);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+// Matrix width and holes must be usable by the translation code
+static int dram_config_check(const struct dram_config* config) {
+    size_t i;
+
+    if (!config->matrix_size || config->matrix_size > BITS_PER_LONG) {
+        printk(KERN_ERR "anvil: %s: matrix size %zu not in 1-%d\n", config->name,
+               config->matrix_size, BITS_PER_LONG);
+        return -EINVAL;
+    }
+    for (i = 1; i < config->nr_holes; ++i) {
+        if (config->holes[i].start < config->holes[i - 1].start + config->holes[i - 1].size) {
+            printk(KERN_ERR "anvil: %s: DRAM holes overlap or are not sorted\n", config->name);
+            return -EINVAL;
+        }
+    }
+    return dram_key_check(config);
+}
+
+// Random pfns of the node must come back unchanged from DRAM coordinates,
+// i.e. addr_matrix must be the inverse of dram_matrix
+static int xlat_roundtrip(const struct dram_node* node) {
+    size_t pfn, phys, local, back;
+    int i;
+
+    if (node->end_pfn <= node->start_pfn) {
+        return 0;
+    }
+
+    for (i = 0; i < XLAT_ROUNDTRIP_ROUNDS; ++i) {
+        pfn = node->start_pfn + get_random_long() % (node->end_pfn - node->start_pfn);
+        phys = PFN_TO_PHYS(pfn);
+        // holes and memory beyond the matrix are not translated anyway
+        if (!phys_to_local(node, phys, &local)) {
+            continue;
+        }
+        back = local_to_phys(node, xlat_apply(node->to_phys, xlat_apply(node->to_dram, local)));
+        if (back != phys) {
+            printk(KERN_ERR "anvil: %s: pfn 0x%zx translates back to 0x%zx\n",
+                   node->config->name, pfn, PHYS_TO_PFN(back));
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+// Lookup tables of config for node nid, not visible to translations yet
+static struct dram_node* dram_node_create(int nid, const struct dram_config* config) {
+    struct dram_node* node;
+    size_t start, last, local;
+    int ret;
+
+    if (nid < 0 || nid >= MAX_NUMNODES || !node_online(nid)) {
+        return ERR_PTR(-EINVAL);
+    }
+    // the node would alias a lower one in every row key
+    if (nid >= DRAM_ROW_KEY_NODES) {
+        printk(KERN_ERR "anvil: node %d above the %d nodes of a row key\n", nid, DRAM_ROW_KEY_NODES);
+        return ERR_PTR(-ERANGE);
+    }
+    ret = dram_config_check(config);
+    if (ret) {
+        return ERR_PTR(ret);
+    }
+
+    node = kzalloc_node(sizeof(*node), GFP_KERNEL, nid);
+    if (!node) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    node->nid = nid;
+    node->config = config;
+    node->start_pfn = node_start_pfn(nid);
+    node->end_pfn = node_end_pfn(nid);
+    // The DRAM of a node starts at its first page, rounded down to the size
+    // covered by the matrix
+    node->offset = config->phys_dram_offset;
+    start = phys_without_holes(config, PFN_TO_PHYS(node->start_pfn));
+    if (config->matrix_size < BITS_PER_LONG && start != SIZE_MAX) {
+        node->offset += round_down(start, (size_t)1 << config->matrix_size);
+    }
+    // Memory beyond the matrix would silently go without refresh
+    last = PFN_TO_PHYS(node->end_pfn - 1);
+    if (node->end_pfn > node->start_pfn && phys_without_holes(config, last) != SIZE_MAX &&
+        !phys_to_local(node, last, &local)) {
+        printk(KERN_ERR "anvil: %s decodes %zu address bits, memory of node %d up to 0x%zx is not covered\n",
+               config->name, config->matrix_size, nid, last + PAGE_SIZE - 1);
+        dram_node_free(node);
+        return ERR_PTR(-ERANGE);
+    }
+
+    ret = dram_xlat_init(node);
+    if (!ret) {
+        ret = xlat_roundtrip(node);
+    }
+    if (ret) {
+        printk(KERN_ERR "anvil: Failed to build DRAM lookup tables for %s on node %d\n", config->name, nid);
+        dram_node_free(node);
+        return ERR_PTR(ret);
+    }
+    return node;
+}
+
+// Publish node, returns the node it replaces. Caller holds dram_mutex and
+// frees the old node after a grace period.
+static struct dram_node* dram_node_install(struct dram_node* node) {
+    int nid = node->nid;
+    struct dram_node* old;
+    unsigned int i;
+
+    old = rcu_replace_pointer(dram_nodes[nid], node, lockdep_is_held(&dram_mutex));
+    if (!old) {
+        // keep the ids sorted
+        for (i = dram_node_count; i > 0 && dram_node_ids[i - 1] > nid; --i) {
+            dram_node_ids[i] = dram_node_ids[i - 1];
+        }
+        dram_node_ids[i] = nid;
+        dram_node_count++;
+    }
+
+    printk(KERN_INFO "anvil: Node %d (pfn 0x%zx-0x%zx) uses mapping for %s\n",
+           nid, node->start_pfn, node->end_pfn, node->config->name);
+    return old;
+}
+
+int register_dram_node_config(int nid, const struct dram_config* config)
+{
+    struct dram_node* node;
+    struct dram_node* old;
+
+    node = dram_node_create(nid, config);
+    if (IS_ERR(node)) {
+        return PTR_ERR(node);
+    }
+
+    mutex_lock(&dram_mutex);
+    old = dram_node_install(node);
+    mutex_unlock(&dram_mutex);
+
+    if (old) {
+        synchronize_rcu();
+        dram_node_free(old);
+    }
+    return 0;
+}
+
+EXPORT_SYMBOL(register_dram_node_config);
+
+int register_dram_mapping(struct dram_mapping_ops *mapping)
+{
+    if (!mapping || !mapping->decode_phys || !mapping->get_row_lines) {
+        return -EINVAL;
+    }
+    dram_def = mapping;
+    printk(KERN_INFO "anvil: Registered mapping for %s\n", mapping->arch_name ? mapping->arch_name : "custom DRAM");
+    return 0;
+}
+
+EXPORT_SYMBOL(register_dram_mapping);
+
+//
+// RUNTIME MAPPING UPLOAD
+//
+
+
+// Inverse of a square matrix over GF(2) with Gauss-Jordan elimination.
+// matrix[i] holds the input bits of output bit size - 1 - i, as in
+// apply_matrix(). Fails for a singular matrix.
+static int gf2_invert(const size_t* matrix, size_t size, size_t* inverse) {
+    size_t rows[BITS_PER_LONG]; // input bits of each output bit
+    size_t aug[BITS_PER_LONG];  // output bits combined into each row
+    size_t col, r, pivot;
+
+    for (r = 0; r < size; ++r) {
+        rows[r] = matrix[size - 1 - r];
+        aug[r] = (size_t)1 << r;
+    }
+
+    for (col = 0; col < size; ++col) {
+        for (pivot = col; pivot < size && !(rows[pivot] & BIT(col)); ++pivot) {
+        }
+        if (pivot == size) {
+            return -EINVAL;
+        }
+        swap(rows[col], rows[pivot]);
+        swap(aug[col], aug[pivot]);
+
+        for (r = 0; r < size; ++r) {
+            if (r != col && (rows[r] & BIT(col))) {
+                rows[r] ^= rows[col];
+                aug[r] ^= aug[col];
+            }
+        }
+    }
+
+    // rows[col] is now input bit col alone, aug[col] the outputs it is made of
+    for (col = 0; col < size; ++col) {
+        inverse[size - 1 - col] = aug[col];
+    }
+    return 0;
+}
+
+// Fields must lie inside the matrix and their row key bits, and must not
+// overlap
+static int dram_layout_check(const struct dram_config* config) {
+    size_t used = 0, bits, mask, shift;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(dram_fields); ++i) {
+        mask = DRAM_CONFIG_FIELD(config, dram_fields[i].mask);
+        shift = DRAM_CONFIG_FIELD(config, dram_fields[i].shift);
+        if (!mask) {
+            continue;
+        }
+        if (shift >= config->matrix_size || (mask << shift) >> shift != mask) {
+            return -EINVAL;
+        }
+        bits = mask << shift;
+        if ((bits & used) || (config->matrix_size < BITS_PER_LONG && (bits >> config->matrix_size))) {
+            return -EINVAL;
+        }
+        used |= bits;
+    }
+    if (!config->bank_mask || !config->row_mask || !config->column_mask) {
+        return -EINVAL;
+    }
+    return dram_key_check(config);
+}
+
+static int parse_size_list(char* val, size_t* out, size_t max, size_t* n) {
+    char* tok;
+    int ret;
+
+    *n = 0;
+    while ((tok = strsep(&val, ",")) != NULL) {
+        if (*n == max) {
+            return -E2BIG;
+        }
+        ret = kstrtoul(tok, 0, &out[(*n)++]);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int parse_upload_token(struct dram_upload* up, char* key, char* val, int* nid) {
+    struct dram_config* config = &up->config;
+    size_t values[2 * DRAM_UPLOAD_HOLES_MAX];
+    char* shift;
+    size_t i, n;
+    int ret;
+
+    if (!strcmp(key, "node")) {
+        return strcmp(val, "all") ? kstrtoint(val, 0, nid) : 0;
+    }
+    if (!strcmp(key, "name")) {
+        return strscpy(up->name, val, sizeof(up->name)) < 0 ? -E2BIG : 0;
+    }
+    if (!strcmp(key, "offset")) {
+        return kstrtoul(val, 0, &config->phys_dram_offset);
+    }
+    if (!strcmp(key, "matrix")) {
+        return parse_size_list(val, up->dram_matrix, BITS_PER_LONG, &config->matrix_size);
+    }
+    if (!strcmp(key, "holes")) {
+        // start:size pairs
+        for (i = 0; val[i]; ++i) {
+            if (val[i] == ':') {
+                val[i] = ',';
+            }
+        }
+        ret = parse_size_list(val, values, ARRAY_SIZE(values), &n);
+        if (ret || n % 2) {
+            return ret ? ret : -EINVAL;
+        }
+        for (i = 0; i < n / 2; ++i) {
+            up->holes[i].start = values[2 * i];
+            up->holes[i].size = values[2 * i + 1];
+        }
+        config->nr_holes = n / 2;
+        return 0;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(dram_fields); ++i) {
+        if (strcmp(key, dram_fields[i].name)) {
+            continue;
+        }
+        shift = strchr(val, ':');
+        if (!shift) {
+            return -EINVAL;
+        }
+        *shift++ = '\0';
+        ret = kstrtoul(val, 0, &DRAM_CONFIG_FIELD(config, dram_fields[i].mask));
+        return ret ? ret : kstrtoul(shift, 0, &DRAM_CONFIG_FIELD(config, dram_fields[i].shift));
+    }
+    return -EINVAL;
+}
+
+// Copy of an upload for one node, the config points into the copy
+static struct dram_upload* dram_upload_dup(const struct dram_upload* up) {
+    struct dram_upload* copy = kmemdup(up, sizeof(*up), GFP_KERNEL);
+
+    if (copy) {
+        copy->config.name = copy->name;
+        copy->config.dram_matrix = copy->dram_matrix;
+        copy->config.addr_matrix = copy->addr_matrix;
+        copy->config.holes = copy->holes;
+    }
+    return copy;
+}
+
+int dram_mapping_upload(const char* buf, size_t count)
+{
+    struct dram_node** nodes;
+    struct dram_node** old;
+    struct dram_upload* up;
+    struct dram_upload* copy;
+    char *text, *cur, *tok, *val;
+    int nid = NUMA_NO_NODE;
+    unsigned int i, n = 0;
+    int ret;
+
+    up = kzalloc(sizeof(*up), GFP_KERNEL);
+    text = kstrndup(buf, count, GFP_KERNEL);
+    // new nodes, then the nodes they replace
+    nodes = kcalloc(2 * nr_node_ids, sizeof(*nodes), GFP_KERNEL);
+    if (!up || !text || !nodes) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    old = nodes + nr_node_ids;
+    strscpy(up->name, "uploaded", sizeof(up->name));
+
+    cur = text;
+    while ((tok = strsep(&cur, " \t\n")) != NULL) {
+        if (!*tok) {
+            continue;
+        }
+        val = strchr(tok, '=');
+        if (!val) {
+            ret = -EINVAL;
+            goto out;
+        }
+        *val++ = '\0';
+        ret = parse_upload_token(up, tok, val, &nid);
+        if (ret) {
+            printk(KERN_ERR "anvil: DRAM mapping upload: bad %s\n", tok);
+            goto out;
+        }
+    }
+
+    ret = dram_config_check(&up->config);
+    if (!ret) {
+        ret = dram_layout_check(&up->config);
+        if (ret) {
+            printk(KERN_ERR "anvil: DRAM mapping upload: fields overlap or exceed the matrix\n");
+        }
+    }
+    if (!ret) {
+        ret = gf2_invert(up->dram_matrix, up->config.matrix_size, up->addr_matrix);
+        if (ret) {
+            printk(KERN_ERR "anvil: DRAM mapping upload: matrix is singular\n");
+        }
+    }
+    if (ret) {
+        goto out;
+    }
+
+    // build every node first, the swap itself cannot fail
+    mutex_lock(&dram_mutex);
+    if (!dram_def || !dram_node_count || (nid != NUMA_NO_NODE && !dram_node_by_id_locked(nid))) {
+        ret = -ENODEV;
+        goto unlock;
+    }
+    for (i = 0; i < dram_node_count; ++i) {
+        if (nid != NUMA_NO_NODE && dram_node_ids[i] != nid) {
+            continue;
+        }
+        copy = dram_upload_dup(up);
+        if (!copy) {
+            ret = -ENOMEM;
+            goto unlock;
+        }
+        nodes[n] = dram_node_create(dram_node_ids[i], &copy->config);
+        if (IS_ERR(nodes[n])) {
+            ret = PTR_ERR(nodes[n]);
+            nodes[n] = NULL;
+            kfree(copy);
+            goto unlock;
+        }
+        nodes[n++]->upload = copy;
+    }
+
+    for (i = 0; i < n; ++i) {
+        old[i] = dram_node_install(nodes[i]);
+        nodes[i] = NULL;
+    }
+
+unlock:
+    mutex_unlock(&dram_mutex);
+    // translations in flight finish with the old tables
+    synchronize_rcu();
+    // row keys of the old tables name other rows now
+    if (!ret) {
+        WRITE_ONCE(dram_mapping_gen, dram_mapping_gen + 1);
+    }
+    for (i = 0; i < n; ++i) {
+        dram_node_free(old[i]);
+        dram_node_free(nodes[i]);
+    }
+out:
+    kfree(nodes);
+    kfree(text);
+    kfree(up);
+    return ret ? ret : count;
+}
+
+EXPORT_SYMBOL(dram_mapping_upload);
+
+ssize_t dram_mapping_show(char* buf)
+{
+    const struct dram_node* node;
+    ssize_t len = 0;
+    unsigned int i;
+
+    rcu_read_lock();
+    for (i = 0; i < dram_node_count; ++i) {
+        node = rcu_dereference(dram_nodes[dram_node_ids[i]]);
+        len += sysfs_emit_at(buf, len, "%d %s bits=%zu offset=0x%zx holes=%zu\n",
+                             node->nid, node->config->name, node->config->matrix_size,
+                             node->offset, node->config->nr_holes);
+    }
+    rcu_read_unlock();
+    return len;
+}
+
+EXPORT_SYMBOL(dram_mapping_show);
+
 int detect_and_register_dram_mapping(void)
 {
+    int nid;
+    int ret;
 
         struct cpuinfo_x86 *c = &boot_cpu_data;
 
@@ -108,6 +915,19 @@ int detect_and_register_dram_mapping(void)
     */
 
     if (active_config) {
+        // every node with memory starts with the config of the CPU
+        for_each_node_state(nid, N_MEMORY) {
+            if (nid >= DRAM_ROW_KEY_NODES) {
+                printk(KERN_WARNING "anvil: Node %d and above are not translated\n", nid);
+                break;
+            }
+            ret = register_dram_node_config(nid, active_config);
+            if (ret) {
+                dram_nodes_free();
+                active_config = NULL;
+                return ret;
+            }
+        }
         generic_dram_ops.arch_name = active_config->name;
         dram_def = &generic_dram_ops;
         printk(KERN_INFO "anvil: Detected and registered mapping for %s\n", active_config->name);
@@ -119,3 +939,14 @@ int detect_and_register_dram_mapping(void)
 }
 
 EXPORT_SYMBOL(detect_and_register_dram_mapping);
+
+void unregister_dram_mapping(void)
+{
+    mutex_lock(&dram_mutex);
+    dram_def = NULL;
+    active_config = NULL;
+    dram_nodes_free();
+    mutex_unlock(&dram_mutex);
+}
+
+EXPORT_SYMBOL(unregister_dram_mapping);
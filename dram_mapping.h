@@ -3,26 +3,108 @@
 
 #include <linux/types.h>
 
+struct dram_coords {
+    // NUMA node whose mapping the coordinates belong to
+    size_t node;
+    size_t channel;
+    size_t rank;
+    size_t bank_group;
+    size_t bank;
+    size_t row;
+    size_t column;
+};
+
+// Rows as a single key: node in bits 60-63, channel in bits 56-59, rank in
+// bits 52-55, bank group in bits 48-51, bank in bits 40-47, row below
+#define DRAM_ROW_KEY_NODE_SHIFT 60
+#define DRAM_ROW_KEY_CHANNEL_SHIFT 56
+#define DRAM_ROW_KEY_RANK_SHIFT 52
+#define DRAM_ROW_KEY_BANK_GROUP_SHIFT 48
+#define DRAM_ROW_KEY_BANK_SHIFT 40
+// Nodes a key can tell apart. Higher nodes get no config, their addresses
+// are not decoded.
+#define DRAM_ROW_KEY_NODES (1 << (64 - DRAM_ROW_KEY_NODE_SHIFT))
+
+#define DRAM_ROW_KEY_FIELD(key, shift, next) (((key) >> (shift)) & ((1ULL << ((next) - (shift))) - 1))
+
+static inline u64 dram_row_key(const struct dram_coords *coords)
+{
+    return ((u64)coords->node << DRAM_ROW_KEY_NODE_SHIFT) |
+           ((u64)coords->channel << DRAM_ROW_KEY_CHANNEL_SHIFT) |
+           ((u64)coords->rank << DRAM_ROW_KEY_RANK_SHIFT) |
+           ((u64)coords->bank_group << DRAM_ROW_KEY_BANK_GROUP_SHIFT) |
+           ((u64)coords->bank << DRAM_ROW_KEY_BANK_SHIFT) | coords->row;
+}
+
+static inline void dram_row_from_key(u64 key, struct dram_coords *coords)
+{
+    coords->node = key >> DRAM_ROW_KEY_NODE_SHIFT;
+    coords->channel = DRAM_ROW_KEY_FIELD(key, DRAM_ROW_KEY_CHANNEL_SHIFT, DRAM_ROW_KEY_NODE_SHIFT);
+    coords->rank = DRAM_ROW_KEY_FIELD(key, DRAM_ROW_KEY_RANK_SHIFT, DRAM_ROW_KEY_CHANNEL_SHIFT);
+    coords->bank_group = DRAM_ROW_KEY_FIELD(key, DRAM_ROW_KEY_BANK_GROUP_SHIFT, DRAM_ROW_KEY_RANK_SHIFT);
+    coords->bank = DRAM_ROW_KEY_FIELD(key, DRAM_ROW_KEY_BANK_SHIFT, DRAM_ROW_KEY_BANK_GROUP_SHIFT);
+    coords->row = key & ((1ULL << DRAM_ROW_KEY_BANK_SHIFT) - 1);
+    coords->column = 0;
+}
+
+// Same node, channel, rank, bank group and bank
+static inline bool dram_same_bank(const struct dram_coords *a, const struct dram_coords *b)
+{
+    return a->node == b->node && a->channel == b->channel && a->rank == b->rank &&
+           a->bank_group == b->bank_group && a->bank == b->bank;
+}
+
+// Victim rows are not an op: the refresh engine takes the rows of an
+// aggressor from decode_phys(), steps the row field and reads each victim
+// through get_row_lines(), which covers every page of the row rather than
+// one pfn per row.
 struct dram_mapping_ops {
+    // Single coordinates, 0 for a pfn that cannot be decoded
     size_t (*get_bank)(size_t pfn);
     size_t (*get_row)(size_t pfn);
     size_t (*get_column)(size_t pfn);
     size_t (*get_rank)(size_t pfn);
 
-    size_t (*get_row_plus)(size_t pfn, int inc);
+    // Decode all coordinates of a pfn with a single translation. False if
+    // the pfn is outside every node, in a hole or beyond the matrix.
+    bool (*decode)(size_t pfn, struct dram_coords *coords);
+    // Same for a physical address, bank bits may depend on the page offset
+    bool (*decode_phys)(size_t phys, struct dram_coords *coords);
 
-    size_t (*get_row_minus)(size_t pfn, int dec);
+    // Physical addresses of the cache lines that make up a row (every field
+    // of coords but the column), at most max. Returns the number written to lines, 0 if
+    // the row does not exist.
+    size_t (*get_row_lines)(const struct dram_coords *coords, size_t *lines, size_t max);
 
     const char *arch_name;
 };
 
 
+// Physical address range that is not DRAM, e.g. the PCI hole below 4 GB.
+// DRAM above a hole continues at its end.
+struct dram_hole {
+    size_t start;
+    size_t size;
+};
+
 struct dram_config {
     const char* name;
     size_t phys_dram_offset; 
+    // Address bits covered by the matrices, up to 64
     size_t matrix_size;
+
+    // Sorted by start, may be empty
+    const struct dram_hole* holes;
+    size_t nr_holes;
     
-    // Masks and shifts to de-linearize a DRAM address
+    // Masks and shifts to de-linearize a DRAM address, a zero mask for a
+    // field the config does not decode
+    size_t channel_mask;
+    size_t channel_shift;
+    size_t rank_mask;
+    size_t rank_shift;
+    size_t bank_group_mask;
+    size_t bank_group_shift;
     size_t bank_mask;
     size_t bank_shift;
     size_t row_mask;
@@ -35,6 +117,11 @@ struct dram_config {
 };
 
 extern struct dram_mapping_ops *dram_def;
+// Addresses that could not be decoded because no config covers them
+extern unsigned long dram_unmapped_count;
+// Bumped once an upload replaced the tables, caches of row keys built with
+// the old ones compare it and start over
+extern unsigned long dram_mapping_gen;
 
 
 
@@ -43,6 +130,15 @@ extern struct dram_config intel_cometlake_config;
 extern struct dram_config amd_zen2_config;
 
 int register_dram_mapping(struct dram_mapping_ops *mapping);
+// Translate the pfn range of NUMA node nid with config. Translations in
+// flight finish with the previous config.
+int register_dram_node_config(int nid, const struct dram_config* config);
+// Parse a phys -> DRAM matrix and field layout ("key=value" tokens), derive
+// the inverse and swap it in for one or all nodes. Returns count or an error.
+int dram_mapping_upload(const char* buf, size_t count);
+// One line per node: id, config name, matrix bits, DRAM offset, holes
+ssize_t dram_mapping_show(char* buf);
 int detect_and_register_dram_mapping(void);
+void unregister_dram_mapping(void);
 
 #endif // DRAM_MAPPING_H
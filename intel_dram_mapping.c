@@ -6,69 +6,87 @@
 #include "linux/export.h"
 
 static const size_t cometlake_dram_matrix[] = {
-        0b000000000000000010000001000000,
-        0b000000000000100100000000000000,
-        0b000000000001001000000000000000,
-        0b000000000010010000000000000000,
-        0b000000000000000001000000000000,
-        0b000000000000000000100000000000,
-        0b000000000000000000010000000000,
-        0b000000000000000000001000000000,
-        0b000000000000000000000100000000,
-        0b000000000000000000000010000000,
-        0b000000000000000000000001000000,
-        0b000000000000000000000000100000,
-        0b000000000000000000000000010000,
-        0b000000000000000000000000001000,
-        0b000000000000000000000000000100,
-        0b000000000000000000000000000010,
-        0b000000000000000000000000000001,
-        0b100000000000000000000000000000,
-        0b010000000000000000000000000000,
-        0b001000000000000000000000000000,
-        0b000100000000000000000000000000,
-        0b000010000000000000000000000000,
-        0b000001000000000000000000000000,
-        0b000000100000000000000000000000,
-        0b000000010000000000000000000000,
-        0b000000001000000000000000000000,
-        0b000000000100000000000000000000,
-        0b000000000010000000000000000000,
-        0b000000000001000000000000000000,
-        0b000000000000100000000000000000
+        0b000000000000000000000000010000001000000,
+        0b000000000000000000000100100000000000000,
+        0b000000000000000000001001000000000000000,
+        0b000000000000000000010010000000000000000,
+        0b000000000000000000000000001000000000000,
+        0b000000000000000000000000000100000000000,
+        0b000000000000000000000000000010000000000,
+        0b000000000000000000000000000001000000000,
+        0b000000000000000000000000000000100000000,
+        0b000000000000000000000000000000010000000,
+        0b000000000000000000000000000000001000000,
+        0b000000000000000000000000000000000100000,
+        0b000000000000000000000000000000000010000,
+        0b000000000000000000000000000000000001000,
+        0b000000000000000000000000000000000000100,
+        0b000000000000000000000000000000000000010,
+        0b000000000000000000000000000000000000001,
+        0b100000000000000000000000000000000000000,
+        0b010000000000000000000000000000000000000,
+        0b001000000000000000000000000000000000000,
+        0b000100000000000000000000000000000000000,
+        0b000010000000000000000000000000000000000,
+        0b000001000000000000000000000000000000000,
+        0b000000100000000000000000000000000000000,
+        0b000000010000000000000000000000000000000,
+        0b000000001000000000000000000000000000000,
+        0b000000000100000000000000000000000000000,
+        0b000000000010000000000000000000000000000,
+        0b000000000001000000000000000000000000000,
+        0b000000000000100000000000000000000000000,
+        0b000000000000010000000000000000000000000,
+        0b000000000000001000000000000000000000000,
+        0b000000000000000100000000000000000000000,
+        0b000000000000000010000000000000000000000,
+        0b000000000000000001000000000000000000000,
+        0b000000000000000000100000000000000000000,
+        0b000000000000000000010000000000000000000,
+        0b000000000000000000001000000000000000000,
+        0b000000000000000000000100000000000000000
 };
 
 static const size_t cometlake_addr_matrix[] = {
-        0b000000000000000001000000000000,
-        0b000000000000000000100000000000,
-        0b000000000000000000010000000000,
-        0b000000000000000000001000000000,
-        0b000000000000000000000100000000,
-        0b000000000000000000000010000000,
-        0b000000000000000000000001000000,
-        0b000000000000000000000000100000,
-        0b000000000000000000000000010000,
-        0b000000000000000000000000001000,
-        0b000000000000000000000000000100,
-        0b000000000000000000000000000010,
-        0b000000000000000000000000000001,
-        0b000100000000000000000000000100,
-        0b001000000000000000000000000010,
-        0b010000000000000000000000000001,
-        0b100000000010000000000000000000,
-        0b000010000000000000000000000000,
-        0b000001000000000000000000000000,
-        0b000000100000000000000000000000,
-        0b000000010000000000000000000000,
-        0b000000001000000000000000000000,
-        0b000000000100000000000000000000,
-        0b000000000010000000000000000000,
-        0b000000000001000000000000000000,
-        0b000000000000100000000000000000,
-        0b000000000000010000000000000000,
-        0b000000000000001000000000000000,
-        0b000000000000000100000000000000,
-        0b000000000000000010000000000000
+        0b000000000000000001000000000000000000000,
+        0b000000000000000000100000000000000000000,
+        0b000000000000000000010000000000000000000,
+        0b000000000000000000001000000000000000000,
+        0b000000000000000000000100000000000000000,
+        0b000000000000000000000010000000000000000,
+        0b000000000000000000000001000000000000000,
+        0b000000000000000000000000100000000000000,
+        0b000000000000000000000000010000000000000,
+        0b000000000000000000000000001000000000000,
+        0b000000000000000000000000000100000000000,
+        0b000000000000000000000000000010000000000,
+        0b000000000000000000000000000001000000000,
+        0b000000000000000000000000000000100000000,
+        0b000000000000000000000000000000010000000,
+        0b000000000000000000000000000000001000000,
+        0b000000000000000000000000000000000100000,
+        0b000000000000000000000000000000000010000,
+        0b000000000000000000000000000000000001000,
+        0b000000000000000000000000000000000000100,
+        0b000000000000000000000000000000000000010,
+        0b000000000000000000000000000000000000001,
+        0b000100000000000000000000000000000000100,
+        0b001000000000000000000000000000000000010,
+        0b010000000000000000000000000000000000001,
+        0b100000000010000000000000000000000000000,
+        0b000010000000000000000000000000000000000,
+        0b000001000000000000000000000000000000000,
+        0b000000100000000000000000000000000000000,
+        0b000000010000000000000000000000000000000,
+        0b000000001000000000000000000000000000000,
+        0b000000000100000000000000000000000000000,
+        0b000000000010000000000000000000000000000,
+        0b000000000001000000000000000000000000000,
+        0b000000000000100000000000000000000000000,
+        0b000000000000010000000000000000000000000,
+        0b000000000000001000000000000000000000000,
+        0b000000000000000100000000000000000000000,
+        0b000000000000000010000000000000000000000
 };
 
 struct dram_config intel_cometlake_config = {
@@ -78,20 +96,22 @@ struct dram_config intel_cometlake_config = {
 
     .phys_dram_offset = 0,
 
-    // 4 bank bits (consisting of rank, bank group, bank)
-    .bank_mask = 0b1111,  // 3 bits for bank
-    .bank_shift = 26,   // bits [5:3]
+    // 4 bank bits (consisting of rank, bank group, bank), not told apart so
+    // rank and bank group decode as 0
+    .bank_mask = 0b1111,
+    .bank_shift = 35,
 
-    // 13 row bits (inside 1 GB)
-    .row_shift = 0,    
-    .row_mask = 0b1111111111111, 
+    // 22 row bits, physical bits [38:17]. Bits 30 and up are identity rows
+    // above the measured first GB.
+    .row_shift = 0,
+    .row_mask = 0x3fffff,
 
     // 13 column bits
-    .column_mask = 0b1111111111111,  
-    .column_shift = 13,    
+    .column_mask = 0b1111111111111,
+    .column_shift = 22,
 
-    // 30 bits (1 GB)
-    .matrix_size = 30,
+    // 39 bits, the physical address width of Comet Lake (512 GB)
+    .matrix_size = 39,
 };
 
 EXPORT_SYMBOL(intel_cometlake_config);